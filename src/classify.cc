@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2026 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include "classify.h"
+
+
+using namespace std;
+
+
+static int unhex(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+
+int classifier::add(const unsigned char *val, const unsigned char *mask, size_t len, size_t offset, uint16_t port)
+{
+	if (len == 0 || port == 0) {
+		err = "classifier::add: empty signature or port";
+		return -1;
+	}
+
+	rule r;
+	r.offset = offset;
+	r.port = port;
+	for (size_t k = 0; k < len; ++k) {
+		unsigned char m = mask ? mask[k] : 0xff;
+		r.val.push_back(val[k] & m);
+		r.mask.push_back(m);
+	}
+	rules.push_back(r);
+	return 0;
+}
+
+
+int classifier::add(const string &sig, uint16_t port)
+{
+	vector<unsigned char> val, mask;
+	size_t offset = 0, i = 0;
+
+	if (sig.size() > 1 && sig[0] == '=')
+		return add((const unsigned char *)sig.c_str() + 1, NULL, sig.size() - 1, 0, port);
+
+	string::size_type plus = sig.find('+');
+	if (plus != string::npos) {
+		offset = strtoul(sig.c_str(), NULL, 10);
+		i = plus + 1;
+	}
+
+	string::size_type slash = sig.find('/', i);
+	string hex = sig.substr(i, slash == string::npos ? string::npos : slash - i);
+	for (size_t k = 0; k + 1 < hex.size(); k += 2) {
+		if (hex[k] == '?' && hex[k + 1] == '?') {
+			val.push_back(0);
+			mask.push_back(0);
+			continue;
+		}
+		int h = unhex(hex[k]), l = unhex(hex[k + 1]);
+		if (h < 0 || l < 0)
+			break;
+		val.push_back(h<<4|l);
+		mask.push_back(0xff);
+	}
+	if (val.empty() || val.size() * 2 != hex.size()) {
+		err = "classifier::add: bad signature " + sig;
+		return -1;
+	}
+
+	if (slash != string::npos) {
+		string m = sig.substr(slash + 1);
+		if (m.size() != hex.size()) {
+			err = "classifier::add: mask length differs in " + sig;
+			return -1;
+		}
+		for (size_t k = 0; k < val.size(); ++k) {
+			int h = unhex(m[2*k]), l = unhex(m[2*k + 1]);
+			if (h < 0 || l < 0) {
+				err = "classifier::add: bad mask in " + sig;
+				return -1;
+			}
+			mask[k] &= h<<4|l;
+		}
+	}
+
+	return add(&val[0], &mask[0], val.size(), offset, port);
+}
+
+
+// All rules start at byte 0 and advance in lockstep, so a DFA state is
+// just the depth, the rule completed on entering it and the set of rules
+// still alive.
+int classifier::compile()
+{
+	typedef pair<pair<size_t, int>, vector<int> > key_t;
+	map<key_t, int> ids;
+	vector<key_t> todo;
+
+	next.clear();
+	accept.clear();
+	alive.clear();
+
+	key_t start;
+	start.first = make_pair(0, -1);
+	for (size_t r = 0; r < rules.size(); ++r)
+		start.second.push_back(r);
+
+	ids[start] = 0;
+	todo.push_back(start);
+	accept.push_back(-1);
+	alive.push_back(rules.empty() ? -1 : 0);
+	next.resize(256, -1);
+
+	for (size_t s = 0; s < todo.size(); ++s) {
+		size_t depth = todo[s].first.first;
+
+		for (int c = 0; c < 256; ++c) {
+			key_t k;
+			int done = -1;
+
+			for (size_t j = 0; j < todo[s].second.size(); ++j) {
+				int r = todo[s].second[j];
+				const rule &ru = rules[r];
+
+				if (depth >= ru.offset) {
+					size_t p = depth - ru.offset;
+					if ((c & ru.mask[p]) != ru.val[p])
+						continue;
+					if (p + 1 == ru.val.size()) {
+						if (done < 0)
+							done = r;
+						continue;
+					}
+				}
+				k.second.push_back(r);
+			}
+
+			if (done < 0 && k.second.empty())
+				continue;
+			k.first = make_pair(depth + 1, done);
+
+			map<key_t, int>::iterator it = ids.find(k);
+			int id = 0;
+			if (it == ids.end()) {
+				id = todo.size();
+				if (id >= MAX_STATES) {
+					err = "classifier::compile: too many states";
+					return -1;
+				}
+				ids[k] = id;
+				todo.push_back(k);
+				accept.push_back(done);
+				alive.push_back(k.second.empty() ? -1 : k.second[0]);
+				next.resize(next.size() + 256, -1);
+			} else
+				id = it->second;
+			next[s * 256 + c] = id;
+		}
+	}
+	return 0;
+}
+
+
+uint16_t classifier::match(const unsigned char *buf, size_t len) const
+{
+	int best = -1, s = 0;
+
+	if (accept.empty())
+		return 0;
+
+	for (size_t i = 0; i < len; ++i) {
+		if ((s = next[s * 256 + buf[i]]) < 0)
+			break;
+		if (accept[s] >= 0 && (best < 0 || accept[s] < best))
+			best = accept[s];
+		// nothing left that could beat what we have
+		if (alive[s] < 0 || (best >= 0 && alive[s] > best))
+			break;
+	}
+	return best < 0 ? 0 : rules[best].port;
+}
+
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2026 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef sshttp_classify_h
+#define sshttp_classify_h
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+
+// Maps the first bytes of a connection to a backend port. Rules are byte
+// signatures with per-byte masks at a fixed offset. They are compiled into
+// a DFA over the first bytes, so a lookup is one table step per byte, no
+// matter how many rules there are. The first added rule wins if several
+// match.
+class classifier {
+	struct rule {
+		size_t offset;
+		std::vector<unsigned char> val, mask;
+		uint16_t port;
+	};
+
+	std::vector<rule> rules;
+
+	// DFA: next[state * 256 + byte], -1 is dead
+	std::vector<int32_t> next;
+
+	// per state: rule that completed on entering it (-1 if none), and
+	// the lowest rule index still alive
+	std::vector<int32_t> accept, alive;
+
+	std::string err;
+
+public:
+	enum {
+		MAX_STATES = 1<<14
+	};
+
+	classifier() : err("") {}
+
+	// "=text" for a literal prefix, or "[offset+]hex[/hexmask]" where
+	// "??" in hex matches any byte
+	int add(const std::string &, uint16_t);
+
+	int add(const unsigned char *, const unsigned char *, size_t, size_t, uint16_t);
+
+	int compile();
+
+	// 0 if no rule matches
+	uint16_t match(const unsigned char *, size_t) const;
+
+	size_t states() const
+	{
+		return accept.size();
+	}
+
+	const char *why()
+	{
+		return err.c_str();
+	}
+};
+
+#endif
+
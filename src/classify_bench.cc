@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2026 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// Classification cost per connection: the compiled classifier against a
+// plain rule-by-rule scan, over a mix of first flights.
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include "classify.h"
+
+
+using namespace std;
+
+
+struct sig {
+	size_t offset;
+	vector<unsigned char> val, mask;
+	uint16_t port;
+};
+
+
+// same syntax as classifier::add(), for the scan
+static sig parse(string s, uint16_t port)
+{
+	sig r;
+	r.offset = 0;
+	r.port = port;
+
+	if (s[0] == '=') {
+		r.val.assign(s.begin() + 1, s.end());
+		r.mask.assign(s.size() - 1, 0xff);
+		return r;
+	}
+	string::size_type i = s.find('+');
+	if (i != string::npos) {
+		r.offset = atoi(s.c_str());
+		s = s.substr(i + 1);
+	}
+	string m = "";
+	if ((i = s.find('/')) != string::npos) {
+		m = s.substr(i + 1);
+		s = s.substr(0, i);
+	}
+	for (size_t k = 0; k < s.size(); k += 2) {
+		unsigned int b = 0, mb = 0xff;
+		if (s[k] == '?')
+			mb = 0;
+		else
+			sscanf(s.c_str() + k, "%2x", &b);
+		if (m.size())
+			sscanf(m.c_str() + k, "%2x", &mb);
+		r.val.push_back(b & mb);
+		r.mask.push_back(mb);
+	}
+	return r;
+}
+
+
+static uint16_t linear(const vector<sig> &v, const unsigned char *buf, size_t len)
+{
+	for (size_t i = 0; i < v.size(); ++i) {
+		const sig &s = v[i];
+		if (s.offset + s.val.size() > len)
+			continue;
+		size_t k = 0;
+		for (; k < s.val.size(); ++k) {
+			if ((buf[s.offset + k] & s.mask[k]) != s.val[k])
+				break;
+		}
+		if (k == s.val.size())
+			return s.port;
+	}
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	int n = argc > 1 ? atoi(argv[1]) : 100, rounds = 2000000;
+	const char *named[][2] = {
+		{"=SSH-", "22"},
+		{"2+38/f8", "1194"},		// OpenVPN TCP, hard reset
+		{"030000", "3389"},		// RDP, TPKT
+		{"=<?xml", "5222"},		// XMPP
+		{"=PRI * HTTP/2.0", "8081"},	// HTTP/2 prior knowledge
+		{"=PROXY ", "8082"},		// PROXY v1
+		{"0d0a0d0a000d0a515549540a", "8082"},	// PROXY v2
+		{"05??00", "1080"}		// SOCKS5
+	};
+	const int nn = sizeof(named)/sizeof(named[0]);
+
+	classifier c;
+	vector<sig> v;
+	char filler[64];
+
+	for (int i = 0; i < n; ++i) {
+		string s;
+		uint16_t port;
+		if (i < nn) {
+			s = named[i][0];
+			port = atoi(named[i][1]);
+		} else {
+			// binary filler that never matches the flights below
+			snprintf(filler, sizeof(filler), "%u+%02x%02x%02x%02x", i % 8, 0x80 | (rand() & 0x7f),
+			         rand() & 0xff, rand() & 0xff, rand() & 0xff);
+			s = filler;
+			port = 10000 + i;
+		}
+		if (c.add(s, port) < 0) {
+			fprintf(stderr, "%s\n", c.why());
+			return 1;
+		}
+		v.push_back(parse(s, port));
+	}
+	if (c.compile() < 0) {
+		fprintf(stderr, "%s\n", c.why());
+		return 1;
+	}
+
+	const char *flights[] = {
+		"GET /index.html HTTP/1.1\r\nHost: example.com\r\n\r\n",
+		"\x16\x03\x01\x02\x00\x01\x00\x01\xfc\x03\x03",
+		"SSH-2.0-OpenSSH_9.6\r\n",
+		"\x00\x2a\x38\x01\x02\x03\x04\x05\x06\x07\x08",
+		"\x03\x00\x00\x13\x0e\xe0\x00\x00",
+		"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n",
+		"\x05\x01\x00",
+		"POST /api HTTP/1.1\r\n"
+	};
+	const size_t nf = sizeof(flights)/sizeof(flights[0]);
+	size_t lens[nf];
+	// binary flights carry NULs, so take the literal's length
+	lens[0] = strlen(flights[0]); lens[1] = 11; lens[2] = strlen(flights[2]);
+	lens[3] = 11; lens[4] = 8; lens[5] = strlen(flights[5]); lens[6] = 3;
+	lens[7] = strlen(flights[7]);
+
+	for (size_t f = 0; f < nf; ++f) {
+		uint16_t a = c.match((const unsigned char *)flights[f], lens[f]);
+		uint16_t b = linear(v, (const unsigned char *)flights[f], lens[f]);
+		if (a != b) {
+			fprintf(stderr, "mismatch on flight %zu: %u vs %u\n", f, a, b);
+			return 1;
+		}
+	}
+
+	unsigned long sum = 0;
+	auto t0 = chrono::steady_clock::now();
+	for (int i = 0; i < rounds; ++i) {
+		size_t f = i % nf;
+		sum += c.match((const unsigned char *)flights[f], lens[f]);
+	}
+	auto t1 = chrono::steady_clock::now();
+	for (int i = 0; i < rounds; ++i) {
+		size_t f = i % nf;
+		sum += linear(v, (const unsigned char *)flights[f], lens[f]);
+	}
+	auto t2 = chrono::steady_clock::now();
+
+	double dfa = chrono::duration<double, nano>(t1 - t0).count() / rounds;
+	double scan = chrono::duration<double, nano>(t2 - t1).count() / rounds;
+	printf("%d rules, %zu states: %.1f ns/conn compiled, %.1f ns/conn scan (%lu)\n",
+	       n, c.states(), dfa, scan, sum);
+	return 0;
+}
+
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2026 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/eventfd.h>
+#include "handoff.h"
+
+
+using namespace std;
+
+
+handoff::~handoff()
+{
+	for (size_t k = 0; k < queues.size(); ++k)
+		delete queues[k];
+	for (size_t k = 0; k < evfds.size(); ++k)
+		close(evfds[k]);
+	delete [] loads;
+}
+
+
+int handoff::init(int a, int w)
+{
+	acceptors = a;
+	workers = w;
+
+	loads = new load_t[workers];
+	for (int k = 0; k < workers; ++k) {
+		loads[k].n.store(0);
+		int fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+		if (fd < 0) {
+			err = "handoff::init::eventfd:";
+			err += strerror(errno);
+			return -1;
+		}
+		evfds.push_back(fd);
+	}
+
+	for (int k = 0; k < acceptors * workers; ++k)
+		queues.push_back(new spsc_queue<item>(QUEUE_SIZE));
+	pending.resize(acceptors * workers, 0);
+	return 0;
+}
+
+
+int handoff::push(int a, const item &it)
+{
+	// least loaded first, then whoever has room
+	int best = 0;
+	for (int k = 1; k < workers; ++k) {
+		if (loads[k].n.load(std::memory_order_relaxed) < loads[best].n.load(std::memory_order_relaxed))
+			best = k;
+	}
+
+	for (int j = 0; j < workers; ++j) {
+		int w = (best + j) % workers;
+		if (!queues[a * workers + w]->push(it))
+			continue;
+		loads[w].n.fetch_add(2, std::memory_order_relaxed);
+		pending[a * workers + w] = 1;
+		return w;
+	}
+	return -1;
+}
+
+
+void handoff::flush(int a)
+{
+	uint64_t one = 1;
+
+	for (int w = 0; w < workers; ++w) {
+		if (!pending[a * workers + w])
+			continue;
+		pending[a * workers + w] = 0;
+		// EAGAIN: counter is pending anyway
+		if (write(evfds[w], &one, sizeof(one)) < 0)
+			continue;
+	}
+}
+
+
+bool handoff::pop(int w, item &it)
+{
+	for (int a = 0; a < acceptors; ++a) {
+		if (queues[a * workers + w]->pop(it))
+			return true;
+	}
+	return false;
+}
+
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2026 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef sshttp_handoff_h
+#define sshttp_handoff_h
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+
+// Lock-free ring for one producer and one consumer thread. The size
+// must be a power of two.
+template<typename T>
+class spsc_queue {
+	T *ring;
+	uint32_t mask;
+
+	// consumer and producer index on their own cache lines
+	char pad0[64];
+	std::atomic<uint32_t> head;
+	char pad1[64];
+	std::atomic<uint32_t> tail;
+	char pad2[64];
+
+	spsc_queue(const spsc_queue &);
+
+	spsc_queue &operator=(const spsc_queue &);
+
+public:
+	explicit spsc_queue(uint32_t n) : ring(new T[n]), mask(n - 1), head(0), tail(0) {}
+
+	~spsc_queue()
+	{
+		delete [] ring;
+	}
+
+	bool push(const T &t)
+	{
+		uint32_t tl = tail.load(std::memory_order_relaxed);
+		if (tl - head.load(std::memory_order_acquire) > mask)
+			return false;
+		ring[tl & mask] = t;
+		tail.store(tl + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T &t)
+	{
+		uint32_t hd = head.load(std::memory_order_relaxed);
+		if (hd == tail.load(std::memory_order_acquire))
+			return false;
+		t = ring[hd & mask];
+		head.store(hd + 1, std::memory_order_release);
+		return true;
+	}
+};
+
+
+// Passes decided client/backend pairs from acceptor threads to relay
+// worker threads. Every (acceptor, worker) pair has its own spsc_queue,
+// and each worker sleeps on an eventfd that acceptors signal after a
+// batch of pushes.
+class handoff {
+public:
+	enum {
+		QUEUE_SIZE = 1024
+	};
+
+	struct item {
+		int fd, peer_fd;
+		int state, peer_state;		// status_t of both ends
+		short events, peer_events;	// poll interest of both ends
+		char *buf;			// pending client data, owned by the item
+		uint32_t size, head, blen;
+	};
+
+private:
+	int acceptors, workers;
+
+	// queues[a * workers + w]
+	std::vector<spsc_queue<item> *> queues;
+
+	// workers to wake, per acceptor like the queues
+	std::vector<char> pending;
+
+	std::vector<int> evfds;
+
+	// open fds per worker, including those still queued
+	struct load_t {
+		std::atomic<int> n;
+		char pad[64 - sizeof(std::atomic<int>)];
+	} *loads;
+
+	std::string err;
+
+	handoff(const handoff &);
+
+	handoff &operator=(const handoff &);
+
+public:
+	handoff() : acceptors(0), workers(0), loads(NULL), err("") {}
+
+	~handoff();
+
+	int init(int, int);
+
+	int event_fd(int w)
+	{
+		return evfds[w];
+	}
+
+	// acceptor a: queue it to the least loaded worker that has room,
+	// returns the worker or -1 if all queues are full
+	int push(int a, const item &);
+
+	// acceptor a: wake the workers it pushed to since the last flush
+	void flush(int a);
+
+	// worker w: next item from any acceptor
+	bool pop(int w, item &);
+
+	// worker w closed n fds
+	void done(int w, int n)
+	{
+		loads[w].n.fetch_sub(n, std::memory_order_relaxed);
+	}
+
+	const char *why()
+	{
+		return err.c_str();
+	}
+};
+
+#endif
+
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2026 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <cstring>
+#include <vector>
+#include <netinet/in.h>
+#include "history.h"
+
+
+using namespace std;
+
+
+void proto_history::resize(uint32_t n)
+{
+	sets = 0;
+	table.clear();
+	hands.clear();
+
+	if (n < WAYS)
+		return;
+	sets = 1;
+	while (sets * 2 * WAYS <= n)
+		sets *= 2;
+}
+
+
+proto_history::entry *proto_history::find(const sockaddr *sa, uint64_t &k0, uint64_t &k1, uint32_t &set)
+{
+	k0 = 0;
+	k1 = 0;
+	if (sa->sa_family == AF_INET6) {
+		const unsigned char *a = ((const sockaddr_in6 *)sa)->sin6_addr.s6_addr;
+		memcpy(&k0, a, 8);
+		memcpy(&k1, a + 8, 8);
+	} else {
+		k1 = ((const sockaddr_in *)sa)->sin_addr.s_addr;
+	}
+
+	uint64_t h = k0 * 0x9e3779b97f4a7c15ULL ^ k1 * 0xc2b2ae3d27d4eb4fULL;
+	set = (uint32_t)(h >> 32) & (sets - 1);
+
+	if (table.empty()) {
+		table.resize(sets * WAYS);
+		hands.resize(sets);
+		memset(&table[0], 0, table.size() * sizeof(entry));
+	}
+
+	entry *e = &table[set * WAYS];
+	for (int w = 0; w < WAYS; ++w) {
+		if (e[w].port != 0 && e[w].k0 == k0 && e[w].k1 == k1)
+			return &e[w];
+	}
+	return NULL;
+}
+
+
+uint16_t proto_history::get(const sockaddr *sa)
+{
+	if (!sets)
+		return 0;
+
+	uint64_t k0, k1;
+	uint32_t set;
+	entry *e = find(sa, k0, k1, set);
+	if (!e)
+		return 0;
+	e->ref = 1;
+	return e->port;
+}
+
+
+void proto_history::put(const sockaddr *sa, uint16_t port)
+{
+	if (!sets)
+		return;
+
+	uint64_t k0, k1;
+	uint32_t set;
+	entry *e = find(sa, k0, k1, set);
+
+	// CLOCK: take the first way whose reference bit is clear, clearing
+	// the ones passed on the way
+	if (!e) {
+		entry *s = &table[set * WAYS];
+		for (;;) {
+			e = &s[hands[set]];
+			hands[set] = (hands[set] + 1) % WAYS;
+			if (!e->ref)
+				break;
+			e->ref = 0;
+		}
+		e->k0 = k0;
+		e->k1 = k1;
+	}
+	e->port = port;
+	e->ref = 1;
+}
+
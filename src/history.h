@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2026 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef sshttp_history_h
+#define sshttp_history_h
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <vector>
+
+
+// Remembers the last decided backend port per client address, so that
+// returning SSH clients need not be waited for. The table is a set
+// associative hash with CLOCK replacement inside each set, so its size
+// is fixed and no lists are chased on lookup.
+class proto_history {
+	enum {
+		WAYS = 4
+	};
+
+	struct entry {
+		uint64_t k0, k1;	// v6 address, or v4 address in k1
+		uint16_t port;		// 0 if unused
+		uint8_t ref;		// CLOCK reference bit
+	};
+
+	std::vector<entry> table;
+	std::vector<uint8_t> hands;
+	uint32_t sets;
+
+	entry *find(const sockaddr *, uint64_t &, uint64_t &, uint32_t &);
+
+public:
+	proto_history() : sets(0) {}
+
+	// number of entries, rounded to a power of two, 0 disables; the
+	// table itself is allocated on first use
+	void resize(uint32_t);
+
+	bool enabled() const
+	{
+		return sets > 0;
+	}
+
+	// 0 if unknown
+	uint16_t get(const sockaddr *);
+
+	void put(const sockaddr *, uint16_t);
+};
+
+#endif
+
@@ -46,6 +46,7 @@
 #include <grp.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <pthread.h>
 
 #ifdef USE_CAPS
 #include <sys/prctl.h>
@@ -66,6 +67,95 @@ namespace Config
 	int cores = -1, master = 1;
 	bool v6 = 0;
 	bool tproxy = 0;
+	bool uring = 0;
+	bool splice = 0;
+	bool preconnect = 0;
+	bool fastopen = 0;
+	bool zerocopy = 0;
+	bool offload = 0;
+	bool reuseport = 0;
+	bool threads = 0;
+	int acceptors = 0;
+	uint32_t history = 0;
+	uint32_t protocol_ms = TIMEOUT_PROTOCOL, banner_ms = TIMEOUT_MAILBANNER;
+	uint32_t buf_max = BUF_MAX, budget = DRAIN_BUDGET;
+	uint32_t spares = SPARE_MAX;
+	uint32_t fd_max = FD_MAX;
+	vector<uint16_t> proxy;
+	map<uint16_t, string> unix_paths;
+}
+
+
+void sigusr1(int)
+{
+	sshttp::stats_requested = sshttp::stats_requested + 1;
+}
+
+
+struct worker_arg {
+	const sshttp *tmpl;
+	handoff *ho;
+	bool acceptor;
+	int idx, cpu, family, sock;
+};
+
+
+// a threaded worker, owning its own sshttp instance
+void *worker_thread(void *vp)
+{
+	worker_arg *wa = (worker_arg *)vp;
+	const char *role = wa->acceptor ? "acceptor" : "worker";
+
+	if (NS_Misc::pin_worker(wa->cpu) < 0)
+		syslog(LOG_INFO, "%s", NS_Misc::why());
+
+	// allocated after pinning, so the tables are local to our node
+	sshttp *sh = new (nothrow) sshttp(*wa->tmpl);
+	if (!sh) {
+		syslog(LOG_ERR, "%s %d: OOM", role, wa->idx);
+		return NULL;
+	}
+#ifdef LINUX26
+	if (wa->ho && wa->acceptor)
+		sh->acceptor_of(wa->ho, wa->idx);
+	else if (wa->ho)
+		sh->relay_for(wa->ho, wa->idx);
+#endif
+	if (sh->init(wa->family, Config::local_port, wa->sock) < 0) {
+		syslog(LOG_ERR, "%s %d: %s", role, wa->idx, sh->why());
+		return NULL;
+	}
+
+	syslog(LOG_INFO, "%s %d on cpu %d node %d", role, wa->idx,
+	       NS_Misc::worker_cpu(wa->cpu), NS_Misc::worker_node(wa->cpu));
+
+	for (;;) {
+		if (sh->loop() < 0)
+			syslog(LOG_ERR, "%s", sh->why());
+	}
+	return NULL;
+}
+
+
+bool start_worker(const sshttp &tmpl, handoff *ho, bool acceptor, int idx, int cpu, int family, int sock)
+{
+	worker_arg *wa = new worker_arg;
+	wa->tmpl = &tmpl;
+	wa->ho = ho;
+	wa->acceptor = acceptor;
+	wa->idx = idx;
+	wa->cpu = cpu;
+	wa->family = family;
+	wa->sock = sock;
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, worker_thread, wa) != 0) {
+		syslog(LOG_ERR, "Failed to start %s thread %d.", acceptor ? "acceptor" : "worker", idx);
+		delete wa;
+		return 0;
+	}
+	pthread_detach(tid);
+	return 1;
 }
 
 
@@ -94,17 +184,79 @@ int main(int argc, char **argv)
 {
 	int c;
 	int family = AF_INET;
-	map<string, uint16_t> sni2port;
+	map<string, uint16_t> sni2port, alpn2port, ech2port, host2port;
+	map<uint16_t, uint16_t> version2port;
+	unsigned int minor = 0;
+	vector<pair<string, uint16_t> > rules;
 	uint16_t sni_port = 0;
+	char *end = NULL;
 	string sni = "";
 	string::size_type idx = 0;
 
 
-	while ((c = getopt(argc, argv, "S:H:L:R:U:n:6l:N:iT")) != -1) {
+	while ((c = getopt(argc, argv, "S:H:L:R:U:n:6l:N:iTuzB:b:PtA:c:w:W:pX:a:E:V:h:s:FY:K:OZC:")) != -1) {
 		switch (c) {
 		case 'T':
 			Config::tproxy = 1;
 			break;
+		case 'u':
+			Config::uring = 1;
+			break;
+		case 'z':
+			Config::splice = 1;
+			break;
+		case 'B':
+			Config::buf_max = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			Config::budget = strtoul(optarg, NULL, 10);
+			break;
+		case 'P':
+			Config::reuseport = 1;
+			break;
+		case 't':
+			Config::threads = 1;
+			break;
+		case 'p':
+			Config::preconnect = 1;
+			break;
+		case 'F':
+			Config::fastopen = 1;
+			break;
+		case 'O':
+			Config::offload = 1;
+			break;
+		case 'Z':
+			Config::zerocopy = 1;
+			break;
+		case 'Y':
+			Config::proxy.push_back(atoi(optarg));
+			break;
+		case 'K':
+			// "port:/path/to/socket"
+			sni_port = (uint16_t)strtoul(optarg, &end, 10);
+			if (sni_port > 0 && *end == ':' && end[1])
+				Config::unix_paths[sni_port] = end + 1;
+			break;
+		case 's':
+			Config::spares = strtoul(optarg, NULL, 10);
+			break;
+		case 'C':
+			Config::fd_max = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			Config::protocol_ms = strtoul(optarg, NULL, 10);
+			break;
+		case 'W':
+			Config::banner_ms = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			Config::history = strtoul(optarg, NULL, 10);
+			break;
+		case 'A':
+			Config::acceptors = atoi(optarg);
+			Config::threads = 1;
+			break;
 		case 'l':
 			Config::laddr = optarg;
 			break;
@@ -133,19 +285,57 @@ int main(int argc, char **argv)
 				Config::laddr = "::";
 			break;
 		case 'N':
+		case 'a':
+		case 'E':
+		case 'h':
+			sni = optarg;
+			idx = sni.rfind(":");
+			if (idx == string::npos || idx + 1 >= sni.size())
+				break;
+			sni_port = (uint16_t)strtoul(sni.c_str() + idx + 1, NULL, 10);
+			if (sni_port <= 0)
+				break;
+			if (c == 'N')
+				sni2port[sni.substr(0, idx)] = sni_port;
+			else if (c == 'a')
+				alpn2port[sni.substr(0, idx)] = sni_port;
+			else if (c == 'h')
+				host2port[sni.substr(0, idx)] = sni_port;
+			else
+				ech2port[sni.substr(0, idx)] = sni_port;
+			break;
+		case 'V':
+			// "1.2:port" for TLS 1.2 (0x0303)
+			if (sscanf(optarg, "1.%u:%hu", &minor, &sni_port) == 2 && minor <= 3 && sni_port > 0)
+				version2port[0x0301 + minor] = sni_port;
+			break;
+		case 'X':
 			sni = optarg;
-			idx = sni.find(":");
+			idx = sni.rfind(":");
 			if (idx == string::npos || idx + 1 >= sni.size())
 				break;
 			sni_port = (uint16_t)strtoul(sni.c_str() + idx + 1, NULL, 10);
 			if (sni_port <= 0)
 				break;
-			sni2port[sni.substr(0, idx)] = sni_port;
+			if (classifier().add(sni.substr(0, idx), sni_port) < 0) {
+				fprintf(stderr, "sshttpd: bad signature %s\n", optarg);
+				exit(1);
+			}
+			rules.push_back(make_pair(sni.substr(0, idx), sni_port));
 			break;
 		default:
-			printf("sshttpd [-n CPU cores] [-S ssh port] [-H http port] [-L lport] [-l laddr] [-6] [-N SNI:port] ");
+			printf("sshttpd [-n CPU cores] [-S ssh port] [-H http port] [-L lport] [-l laddr] [-6] [-N SNI:port] [-h Host:port] [-a ALPN:port] [-E ECH name:port] [-V TLS version:port] [-X sig:port] [-B bufsize] [-b budget] [-c history] [-w ms] [-W ms] [-p] [-s spares] [-C fds] [-Y port] [-K port:path] ");
 #ifdef USE_CAPS
 			printf("[-U user] [-R chroot]");
+#endif
+#ifdef LINUX26
+			printf(" [-z] [-P] [-t] [-A acceptors] [-F] [-Z]");
+#endif
+#ifdef USE_IO_URING
+			printf(" [-u]");
+#endif
+#ifdef USE_SOCKMAP
+			printf(" [-O]");
 #endif
 			printf("\n");
 			exit(1);
@@ -164,17 +354,104 @@ int main(int argc, char **argv)
 	nice(-20);
 	openlog("sshttpd", LOG_NOWAIT|LOG_PID|LOG_NDELAY, LOG_DAEMON);
 
+	int ncpus = NS_Misc::init_multicore();
+#ifndef LINUX26
+	Config::acceptors = 0;
+#endif
+	if (Config::acceptors < 0)
+		Config::acceptors = 0;
+	// by default, acceptors get CPUs of their own
+	if (Config::cores <= 0 && Config::acceptors > 0 && ncpus > Config::acceptors)
+		Config::cores = ncpus - Config::acceptors;
+	if (Config::cores <= 0 || Config::cores > ncpus)
+		Config::cores = ncpus > 0 ? ncpus : 1;
+
 	sshttp sh;
+	sh.ssh_port(Config::ssh_port);
+	sh.http_port(Config::http_port);
+#ifdef USE_IO_URING
+	sh.use_uring(Config::uring);
+#endif
+	sh.use_splice(Config::splice);
+	sh.buffer_max(Config::buf_max);
+	sh.drain_budget(Config::budget);
+	sh.history_size(Config::history);
+	sh.protocol_timeout(Config::protocol_ms);
+	sh.use_preconnect(Config::preconnect);
+	sh.spare_max(Config::spares);
+	sh.fd_max(Config::fd_max);
+	sh.use_fastopen(Config::fastopen);
+	sh.use_zerocopy(Config::zerocopy);
+	for (size_t i = 0; i < Config::proxy.size(); ++i)
+		sh.proxy_port(Config::proxy[i]);
+	for (auto i = Config::unix_paths.begin(); i != Config::unix_paths.end(); ++i)
+		sh.unix_port(i->first, i->second);
+	sh.banner_timeout(Config::banner_ms);
+	for (auto i = sni2port.begin(); i != sni2port.end(); ++i)
+		sh.add_sni(i->first, i->second);
+	for (auto i = host2port.begin(); i != host2port.end(); ++i)
+		sh.add_host(i->first, i->second);
+	for (auto i = alpn2port.begin(); i != alpn2port.end(); ++i)
+		sh.add_alpn(i->first, i->second);
+	for (auto i = ech2port.begin(); i != ech2port.end(); ++i)
+		sh.add_ech(i->first, i->second);
+	for (auto i = version2port.begin(); i != version2port.end(); ++i)
+		sh.add_version(i->first, i->second);
+	for (size_t i = 0; i < rules.size(); ++i)
+		sh.add_rule(rules[i].first, rules[i].second);
+
+#ifdef USE_SOCKMAP
+	// set up per process below, after the multicore fork
+	sockmap smap;
+	if (Config::offload)
+		sh.offload_to(&smap);
+#endif
+
+	// threaded workers are cloned from this, before init()
+	const sshttp tmpl(sh);
+
+	// With acceptor threads, the listeners are theirs and they sit on the
+	// CPUs after those of the relay threads. This thread is acceptor 0.
+	handoff ho;
+	int worker = 0;
+	if (Config::acceptors > 0) {
+		if (ho.init(Config::acceptors, Config::cores) < 0) {
+			fprintf(stderr, "%s\n", ho.why());
+			exit(errno);
+		}
+#ifdef LINUX26
+		sh.acceptor_of(&ho, 0);
+#endif
+		sh.reuseport(Config::acceptors, Config::cores);
+		worker = Config::cores;
+
+	// threads cannot share a listener w/o a lock, so they always shard
+	} else if (Config::reuseport || Config::threads)
+		sh.reuseport(Config::cores);
 	if (sh.init(family, Config::laddr, Config::local_port, Config::tproxy) < 0) {
 		fprintf(stderr, "%s\n", sh.why());
 		exit(errno);
 	}
 
-	for (auto i = sni2port.begin(); i != sni2port.end(); ++i)
-		sh.add_sni(i->first, i->second);
+	if (Config::threads) {
+		if (NS_Misc::pin_worker(worker) < 0)
+			syslog(LOG_INFO, "%s", NS_Misc::why());
+	} else if ((worker = NS_Misc::setup_multicore(Config::cores)) < 0) {
+		syslog(LOG_ERR, "%s", NS_Misc::why());
+		worker = 0;
+	}
+	if (!Config::threads && sh.use_shard(worker) < 0) {
+		syslog(LOG_ERR, "%s", sh.why());
+		exit(1);
+	}
 
-	NS_Misc::init_multicore();
-	NS_Misc::setup_multicore(Config::cores);
+#ifdef USE_SOCKMAP
+	// while we may still load BPF programs; sessions are relayed by
+	// sshttpd itself if this fails
+	struct rlimit rl;
+	if (Config::offload && (getrlimit(RLIMIT_NOFILE, &rl) < 0 || smap.init(rl.rlim_cur) < 0))
+		syslog(LOG_ERR, "%s", smap.why());
+#endif
 
 #ifdef USE_CAPS
 	struct passwd *pw = getpwnam(Config::user.c_str());
@@ -222,9 +499,6 @@ int main(int argc, char **argv)
 
 	dup2(0, 2);
 
-	sh.ssh_port(Config::ssh_port);
-	sh.http_port(Config::http_port);
-
 	syslog(LOG_ERR, "sshttpd started, ready to rock");
 	struct sigaction sa;
 	memset(&sa, 0, sizeof(sa));
@@ -235,6 +509,26 @@ int main(int argc, char **argv)
 	    sigaction(SIGHUP, &sa, NULL) < 0)
 		syslog(LOG_ERR, "Nuts?! Failed to set signal handlers.");
 
+	sa.sa_handler = sigusr1;
+	if (sigaction(SIGUSR1, &sa, NULL) < 0)
+		syslog(LOG_ERR, "Nuts?! Failed to set signal handlers.");
+
+	// after the daemon fork, which would only keep the calling thread
+	if (Config::acceptors > 0) {
+		for (int k = 1; k < Config::acceptors; ++k)
+			start_worker(tmpl, &ho, 1, k, Config::cores + k, family, sh.shard_fd(k));
+		for (int k = 0; k < Config::cores; ++k)
+			start_worker(tmpl, &ho, 0, k, k, family, ho.event_fd(k));
+	} else {
+		for (int k = 1; Config::threads && k < Config::cores; ++k) {
+			if (!start_worker(tmpl, NULL, 0, k, k, family, sh.shard_fd(k)))
+				break;
+		}
+	}
+
+	syslog(LOG_INFO, "%s %d on cpu %d node %d", Config::acceptors > 0 ? "acceptor" : "worker",
+	       Config::acceptors > 0 ? 0 : worker, NS_Misc::worker_cpu(worker), NS_Misc::worker_node(worker));
+
 	for (;;) {
 		if (sh.loop() < 0)
 			syslog(LOG_ERR, "%s", sh.why());
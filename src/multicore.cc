@@ -10,6 +10,8 @@
 #include <cerrno>
 #include <string>
 #include <cstring>
+#include <vector>
+#include <algorithm>
 
 #include "config.h"
 
@@ -18,46 +20,221 @@ namespace NS_Misc {
 using namespace std;
 
 int ncpus = 1;
-string err = "";
+thread_local string err = "";
+
+
+const char *why()
+{
+	return err.c_str();
+}
 
 #ifdef __linux__
 #include <sched.h>
 
-static int get_cores()
+// CPUs to place workers on, in the order they are handed out
+static vector<int> cpus;
+
+
+// parse a sysfs cpu list such as "0-3,8,10-11"
+static vector<int> parse_cpulist(const char *s)
 {
-	int n = 1;
-	char buf[256];
+	vector<int> v;
+	char *end = NULL;
+
+	while (*s) {
+		long a = strtol(s, &end, 10);
+		if (end == s)
+			break;
+		long b = a;
+		s = end;
+		if (*s == '-') {
+			b = strtol(s + 1, &end, 10);
+			s = end;
+		}
+		for (long c = a; c <= b; ++c)
+			v.push_back((int)c);
+		if (*s != ',')
+			break;
+		++s;
+	}
+	return v;
+}
 
-	FILE *f = fopen("/proc/cpuinfo", "r");
-	if (!f) {
-		err = "NS_Misc::get_cores:";
+
+static string read_line(const string &path)
+{
+	char buf[4096];
+
+	FILE *f = fopen(path.c_str(), "r");
+	if (!f)
+		return "";
+	memset(buf, 0, sizeof(buf));
+	if (fgets(buf, sizeof(buf), f) == NULL)
+		buf[0] = 0;
+	fclose(f);
+	return buf;
+}
+
+
+static int cpu_node(int cpu)
+{
+	for (int node = 0; node < 1024; ++node) {
+		string l = read_line("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+		if (l.empty())
+			break;
+		vector<int> v = parse_cpulist(l.c_str());
+		if (find(v.begin(), v.end(), cpu) != v.end())
+			return node;
+	}
+	return 0;
+}
+
+
+// first CPU of the SMT siblings of cpu
+static int cpu_core(int cpu)
+{
+	string l = read_line("/sys/devices/system/cpu/cpu" + to_string(cpu) + "/topology/thread_siblings_list");
+	vector<int> v = parse_cpulist(l.c_str());
+	if (v.empty())
+		return cpu;
+	return *min_element(v.begin(), v.end());
+}
+
+
+// CPUs worth of CFS bandwidth quota in our cgroup, 0 if unlimited
+static int cpu_quota()
+{
+	long long quota = -1, period = 0;
+
+	// cgroup v2: "0::/path"
+	string path = "", l = "";
+	FILE *f = fopen("/proc/self/cgroup", "r");
+	if (f) {
+		char buf[4096];
+		while (fgets(buf, sizeof(buf), f)) {
+			if (strncmp(buf, "0::", 3) == 0) {
+				path = buf + 3;
+				path.erase(path.find_last_not_of("\n") + 1);
+				break;
+			}
+		}
+		fclose(f);
+	}
+
+	if ((l = read_line("/sys/fs/cgroup" + path + "/cpu.max")).empty())
+		l = read_line("/sys/fs/cgroup/cpu.max");
+	if (!l.empty()) {
+		if (l.compare(0, 3, "max") != 0)
+			sscanf(l.c_str(), "%lld %lld", &quota, &period);
+	} else {
+		// cgroup v1
+		quota = strtoll(read_line("/sys/fs/cgroup/cpu/cpu.cfs_quota_us").c_str(), NULL, 10);
+		period = strtoll(read_line("/sys/fs/cgroup/cpu/cpu.cfs_period_us").c_str(), NULL, 10);
+	}
+
+	if (quota <= 0 || period <= 0)
+		return 0;
+	return (int)((quota + period - 1) / period);
+}
+
+
+// Usable CPUs are the online ones in our affinity mask (which honors
+// cpusets). They are ordered by NUMA node, with one CPU per physical
+// core first and SMT siblings last, and cut down to the CFS quota.
+static int get_cores()
+{
+	cpu_set_t mask;
+	CPU_ZERO(&mask);
+	if (sched_getaffinity(0, sizeof(mask), &mask) < 0) {
+		err = "NS_Misc::get_cores::sched_getaffinity:";
 		err += strerror(errno);
 		return -1;
 	}
-	for (;!feof(f);) {
-		memset(buf, 0, sizeof(buf));
-		if (fgets(buf, sizeof(buf), f) == NULL)
-			break;
-		if (string(buf).find("processor") != string::npos)
-			++n;
+
+	vector<int> online = parse_cpulist(read_line("/sys/devices/system/cpu/online").c_str());
+	if (online.empty()) {
+		for (int c = 0; c < CPU_SETSIZE; ++c)
+			online.push_back(c);
 	}
 
-	fclose(f);
-	return n - 1;
+	// (sibling rank, node, cpu)
+	vector<pair<pair<int, int>, int> > v;
+	vector<int> cores;
+	for (size_t i = 0; i < online.size(); ++i) {
+		int c = online[i];
+		if (c < 0 || c >= CPU_SETSIZE || !CPU_ISSET(c, &mask))
+			continue;
+		int core = cpu_core(c), rank = 0;
+		if (find(cores.begin(), cores.end(), core) != cores.end())
+			rank = 1;
+		else
+			cores.push_back(core);
+		v.push_back(make_pair(make_pair(rank, cpu_node(c)), c));
+	}
+	sort(v.begin(), v.end());
+
+	cpus.clear();
+	for (size_t i = 0; i < v.size(); ++i)
+		cpus.push_back(v[i].second);
+
+	int quota = cpu_quota();
+	if (quota > 0 && quota < (int)cpus.size())
+		cpus.resize(quota);
+
+	return cpus.size();
 }
 
 
 int init_multicore()
 {
 	ncpus = get_cores();
-	if (ncpus <= 0)
+	if (ncpus <= 0) {
 		ncpus = 1;
+		cpus.assign(1, 0);
+	}
 	return ncpus;
 }
 
 
+int worker_cpu(int idx)
+{
+	if (idx < 0 || idx >= (int)cpus.size())
+		return -1;
+	return cpus[idx];
+}
+
+
+int worker_node(int idx)
+{
+	int cpu = worker_cpu(idx);
+	return cpu < 0 ? 0 : cpu_node(cpu);
+}
+
+
+// pin the calling thread to the CPU of worker idx
+int pin_worker(int idx)
+{
+	int cpu = worker_cpu(idx);
+	if (cpu < 0)
+		return 0;
+
+	cpu_set_t mask;
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+	if (sched_setaffinity(0, sizeof(mask), &mask) < 0) {
+		err = "NS_Misc::pin_worker::sched_setaffinity:";
+		err += strerror(errno);
+		return -1;
+	}
+	return 0;
+}
+
+
+// returns the index of this worker, 0 for the master
 int setup_multicore(int n)
 {
+	int idx = 0;
+
 	// one core is this thread
 	if (n == 1)
 		return 0;
@@ -67,20 +244,8 @@ int setup_multicore(int n)
 	if (n <= 0 || n > ncpus)
 		n = ncpus;
 
-	cpu_set_t *cpuset = CPU_ALLOC(n);
-	if (!cpuset) {
-		err = "NS_Misc::setup_multicore: OOM";
-		return -1;
-	}
-	size_t size = CPU_ALLOC_SIZE(n);
-	CPU_ZERO_S(size, cpuset);
-	CPU_SET_S(0, size, cpuset);
-	if (sched_setaffinity(getpid(), size, cpuset) < 0) {
-		err = "NS_Misc::setup_multicore::sched_setaffinity:";
-		err += strerror(errno);
-		CPU_FREE(cpuset);
-		return -1;
-	}
+	// placement is best effort
+	pin_worker(0);
 
 	pid_t pid = 0;
 	// fork a child for each core
@@ -89,24 +254,16 @@ int setup_multicore(int n)
 		if (pid < 0) {
 			err = "NS_Misc::setup_multicore::fork:";
 			err += strerror(errno);
-			CPU_FREE(cpuset);
 			return -1;
 		} else if (pid > 0)
 			continue;
-		CPU_ZERO_S(size, cpuset);
-		CPU_SET_S(i, size, cpuset);
-		if (sched_setaffinity(getpid(), size, cpuset) < 0) {
-			err = "NS_Misc::setup_multicore::sched_setaffinity:";
-			err += strerror(errno);
-			CPU_FREE(cpuset);
-			return -1;
-		}
 		Config::master = 0;
+		idx = i;
+		pin_worker(i);
 		break;
 	}
 
-	CPU_FREE(cpuset);
-	return 0;
+	return idx;
 }
 
 }
@@ -119,6 +276,24 @@ int init_multicore()
 }
 
 
+int worker_cpu(int idx)
+{
+	return idx;
+}
+
+
+int worker_node(int)
+{
+	return 0;
+}
+
+
+int pin_worker(int)
+{
+	return 0;
+}
+
+
 int setup_multicore(int n)
 {
 	return 0;
@@ -127,4 +302,3 @@ int setup_multicore(int n)
 }
 
 #endif
-
@@ -7,6 +7,14 @@ int init_multicore();
 
 int setup_multicore(int);
 
+int worker_cpu(int);
+
+int worker_node(int);
+
+int pin_worker(int);
+
+const char *why();
+
 }
 
 #endif
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2026 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "sni.h"
+
+
+using namespace std;
+
+
+static inline char lower(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+
+// FNV-1a over the name from its last byte backwards
+static inline uint32_t step(uint32_t h, char c)
+{
+	return (h ^ (unsigned char)c) * 16777619;
+}
+
+
+static uint32_t rhash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261U;
+	while (len > 0)
+		h = step(h, s[--len]);
+	return h;
+}
+
+
+void sni_table::add(const string &name, uint16_t port)
+{
+	string n = "";
+	for (string::size_type i = 0; i < name.size(); ++i)
+		n += lower(name[i]);
+
+	if (n == "*")
+		any = port;
+	else if (n.size() > 2 && n[0] == '*' && n[1] == '.')
+		wild.push_back(make_pair(n.substr(1), port));
+	else
+		exact.push_back(make_pair(n, port));
+}
+
+
+void sni_table::insert(const string &n, uint16_t port)
+{
+	if (n.size() > HOST_MAX)
+		return;
+
+	uint32_t h = rhash(n.c_str(), n.size());
+
+	// a later -N for the same name overrides the earlier one
+	for (uint32_t i = h & mask;; i = (i + 1) & mask) {
+		slot &s = slots[i];
+		if (s.port == 0) {
+			s.hash = h;
+			s.off = names.size();
+			s.len = n.size();
+			s.port = port;
+			names.insert(names.end(), n.begin(), n.end());
+			return;
+		}
+		if (s.hash == h && s.len == n.size() && memcmp(&names[s.off], n.c_str(), s.len) == 0) {
+			s.port = port;
+			return;
+		}
+	}
+}
+
+
+void sni_table::compile()
+{
+	uint32_t n = 16;
+	while (n < 2*size())
+		n <<= 1;
+
+	slots.assign(n, slot());
+	names.clear();
+	mask = n - 1;
+
+	for (size_t i = 0; i < exact.size(); ++i)
+		insert(exact[i].first, exact[i].second);
+	for (size_t i = 0; i < wild.size(); ++i)
+		insert(wild[i].first, wild[i].second);
+}
+
+
+const sni_table::slot *sni_table::probe(uint32_t h, const char *s, size_t len) const
+{
+	for (uint32_t i = h & mask;; i = (i + 1) & mask) {
+		const slot &sl = slots[i];
+		if (sl.port == 0)
+			return NULL;
+		if (sl.hash == h && sl.len == len && memcmp(&names[sl.off], s, len) == 0)
+			return &sl;
+	}
+}
+
+
+uint16_t sni_table::find(const char *host, size_t len) const
+{
+	char buf[HOST_MAX];
+	uint32_t h[HOST_MAX];	// hash of the suffix starting at i
+	uint32_t x = 2166136261U;
+	const slot *s = NULL;
+
+	if (slots.empty() || len == 0 || len > HOST_MAX)
+		return any;
+
+	for (size_t i = len; i-- > 0;) {
+		buf[i] = lower(host[i]);
+		h[i] = x = step(x, buf[i]);
+	}
+
+	if ((s = probe(h[0], buf, len)) != NULL)
+		return s->port;
+
+	// wildcards are stored as ".domain", longest suffix first
+	for (size_t i = 1; i < len; ++i) {
+		if (buf[i] == '.' && (s = probe(h[i], buf + i, len - i)) != NULL)
+			return s->port;
+	}
+	return any;
+}
+
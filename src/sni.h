@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2026 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef sshttp_sni_h
+#define sshttp_sni_h
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+
+// Read-only SNI routing table, compiled once at startup. Names are kept in
+// an open addressing hash, keyed by a hash that is computed from the end
+// of the name, so one backwards pass over a hostname yields the hashes of
+// all its domain suffixes. A lookup is then one probe for the exact name
+// and one per label for "*.domain" entries, independent of the table size.
+// Matching is case-insensitive and does not allocate.
+class sni_table {
+	struct slot {
+		uint32_t hash;
+		uint32_t off;		// into names
+		uint16_t len;
+		uint16_t port;		// 0 if unused
+	};
+
+	// exact names, and wildcards as their ".domain" suffix
+	std::vector<std::pair<std::string, uint16_t> > exact, wild;
+
+	std::vector<slot> slots;
+	std::vector<char> names;
+	uint32_t mask;
+	uint16_t any;		// "*"
+
+	void insert(const std::string &, uint16_t);
+
+	const slot *probe(uint32_t, const char *, size_t) const;
+
+public:
+	enum {
+		HOST_MAX = 255
+	};
+
+	sni_table() : mask(0), any(0) {}
+
+	// "host.domain", "*.domain" for any name below domain, or "*" for
+	// anything else, including no name at all
+	void add(const std::string &, uint16_t);
+
+	void compile();
+
+	size_t size() const
+	{
+		return exact.size() + wild.size() + (any ? 1 : 0);
+	}
+
+	// exact names before wildcards, longer suffixes before shorter
+	// ones, "*" last; 0 if nothing matches
+	uint16_t find(const char *, size_t) const;
+};
+
+#endif
+
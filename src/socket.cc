@@ -34,8 +34,10 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <sys/un.h>
 #include <string.h>
 #include <string>
+#include <vector>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -48,6 +50,7 @@
 
 #include <linux/netfilter_ipv4.h>
 #include <linux/netfilter_ipv6.h>
+#include <linux/filter.h>
 
 #ifndef IP6T_SO_ORIGINAL_DST
 #define IP6T_SO_ORIGINAL_DST 80
@@ -67,7 +70,8 @@ const int IPV6_TRANSPARENT = 75;
 
 using namespace std;
 
-string error;
+// per thread, workers may run as threads
+thread_local string error;
 
 const char *why()
 {
@@ -90,6 +94,19 @@ int nodelay(int sock)
 }
 
 
+// poll/epoll only report sock as readable once n bytes are queued
+int rcvlowat(int sock, int n)
+{
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVLOWAT, &n, sizeof(n)) < 0) {
+		error = "NS_Socket::rcvlowat::setsockopt: ";
+		error += strerror(errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+
 int transparent(int af, int sock)
 {
 	int one = 1, level = SOL_IP, op = IP_TRANSPARENT;
@@ -120,6 +137,60 @@ int reuse(int sock)
 	return 0;
 }
 
+
+int reuse_port(int sock)
+{
+#ifdef SO_REUSEPORT
+	int one = 1;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+		error = "NS_Socket::reuse_port::setsockopt: ";
+		error += strerror(errno);
+		return -1;
+	}
+	return 0;
+#else
+	error = "NS_Socket::reuse_port: SO_REUSEPORT not supported";
+	return -1;
+#endif
+}
+
+
+// Let the reuseport group of sock pick the listener by the CPU that received
+// the SYN: the listeners were bound in order, so index k belongs to the
+// worker pinned to cpus[k]. Other CPUs are spread by modulo.
+int steer_cpu(int sock, const vector<int> &cpus)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+	vector<struct sock_filter> code;
+	struct sock_filter ld = {BPF_LD|BPF_W|BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)};
+	code.push_back(ld);
+	for (size_t k = 0; k < cpus.size(); ++k) {
+		struct sock_filter jeq = {BPF_JMP|BPF_JEQ|BPF_K, 0, 1, (uint32_t)cpus[k]};
+		struct sock_filter ret = {BPF_RET|BPF_K, 0, 0, (uint32_t)k};
+		code.push_back(jeq);
+		code.push_back(ret);
+	}
+	struct sock_filter mod = {BPF_ALU|BPF_MOD|BPF_K, 0, 0, (uint32_t)cpus.size()};
+	struct sock_filter reta = {BPF_RET|BPF_A, 0, 0, 0};
+	code.push_back(mod);
+	code.push_back(reta);
+
+	struct sock_fprog prog = {(unsigned short)code.size(), &code[0]};
+
+	if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+		error = "NS_Socket::steer_cpu::setsockopt: ";
+		error += strerror(errno);
+		return -1;
+	}
+	return 0;
+#else
+	error = "NS_Socket::steer_cpu: SO_ATTACH_REUSEPORT_CBPF not supported";
+	return -1;
+#endif
+}
+
+
 #ifdef FREEBSD
 #define LINUX22
 #endif
@@ -182,56 +253,171 @@ int bind_local(int sock, const struct sockaddr *s, socklen_t slen, bool do_liste
 }
 
 
+// A non-blocking TCP socket with all options set that do not depend on
+// the addresses, so that only bind() and connect() are left for
+// tcp_connect_on().
+int tcp_socket_nb(int af, bool make_transparent)
+{
+	int sock = socket(af, SOCK_STREAM, 0);
+	if (sock < 0) {
+		error = "NS_Socket::tcp_socket_nb::socket:";
+		error += strerror(errno);
+		return -1;
+	}
+
+	if (fcntl(sock, F_SETFL, O_RDWR|O_NONBLOCK) < 0) {
+		error = "NS_Socket::tcp_socket_nb::fcntl:";
+		error += strerror(errno);
+		close(sock);
+		return -1;
+	}
+
+	if (make_transparent && transparent(af, sock) < 0) {
+		close(sock);
+		return -1;
+	}
+
+	if (reuse(sock) < 0) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+
+// Bind sock to from, unless its port is 0, and start connecting to to.
+// sock is closed on error.
+int tcp_connect_on(int sock, const struct sockaddr *to, socklen_t tolen, const struct sockaddr *from,
+	           socklen_t flen)
+{
+	bool bound = 0;
+
+	if (tolen == sizeof(sockaddr_in6))
+		bound = ((sockaddr_in6 *)from)->sin6_port != 0;
+	else
+		bound = ((sockaddr_in *)from)->sin_port != 0;
+
+	if (bound && bind(sock, from, flen) < 0) {
+		error = "NS_Socket::tcp_connect_on::bind:";
+		error += strerror(errno);
+		close(sock);
+		return -1;
+	}
+
+	if (connect(sock, to, tolen) < 0 && errno != EINPROGRESS) {
+		close(sock);
+		error = "NS_Socket::tcp_connect_on::connect:";
+		error += strerror(errno);
+		return -1;
+	}
+
+	return sock;
+}
+
+
+// As tcp_connect_on(), but try to send buf along with the SYN. Returns the
+// number of bytes that went out that way (or were queued behind the SYN), 0
+// if none did and the connect just proceeds, or -1 on error with sock closed.
+ssize_t tcp_fastopen_on(int sock, const struct sockaddr *to, socklen_t tolen, const struct sockaddr *from,
+	                socklen_t flen, const void *buf, size_t len)
+{
+#ifdef MSG_FASTOPEN
+	bool bound = 0;
+
+	if (tolen == sizeof(sockaddr_in6))
+		bound = ((sockaddr_in6 *)from)->sin6_port != 0;
+	else
+		bound = ((sockaddr_in *)from)->sin_port != 0;
+
+	if (bound && bind(sock, from, flen) < 0) {
+		error = "NS_Socket::tcp_fastopen_on::bind:";
+		error += strerror(errno);
+		close(sock);
+		return -1;
+	}
+
+	ssize_t n = sendto(sock, buf, len, MSG_FASTOPEN, to, tolen);
+	if (n >= 0)
+		return n;
+	// no cookie yet: the SYN went out asking for one
+	if (errno == EINPROGRESS)
+		return 0;
+	// TFO disabled in the kernel, or for this route
+	if (errno != EOPNOTSUPP && errno != EPIPE) {
+		error = "NS_Socket::tcp_fastopen_on::sendto:";
+		error += strerror(errno);
+		close(sock);
+		return -1;
+	}
+
+	if (connect(sock, to, tolen) < 0 && errno != EINPROGRESS) {
+		close(sock);
+		error = "NS_Socket::tcp_fastopen_on::connect:";
+		error += strerror(errno);
+		return -1;
+	}
+	return 0;
+#else
+	(void)buf;
+	(void)len;
+	return tcp_connect_on(sock, to, tolen, from, flen) < 0 ? -1 : 0;
+#endif
+}
+
+
 int tcp_connect_nb(const struct sockaddr *to, socklen_t tolen, const struct sockaddr *from,
 	           socklen_t flen, bool make_transparent)
 {
 	int af = AF_INET;
+	bool bound = 0;
 
-	if (tolen == sizeof(sockaddr_in6))
+	if (tolen == sizeof(sockaddr_in6)) {
 		af = AF_INET6;
+		bound = ((sockaddr_in6 *)from)->sin6_port != 0;
+	} else
+		bound = ((sockaddr_in *)from)->sin_port != 0;
 
-	int sock = socket(af, SOCK_STREAM, 0);
+	int sock = tcp_socket_nb(af, make_transparent && bound);
+	if (sock < 0)
+		return -1;
+
+	return tcp_connect_on(sock, to, tolen, from, flen);
+}
+
+
+// Start connecting to the stream socket at path. Local connects complete at
+// once or fail with EAGAIN if the listen backlog is full.
+int unix_connect_nb(const char *path)
+{
+	sockaddr_un sun;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		error = "NS_Socket::unix_connect_nb: Path too long.";
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (sock < 0) {
-		error = "NS_Socket::tcp_connect_nb::socket:";
+		error = "NS_Socket::unix_connect_nb::socket:";
 		error += strerror(errno);
 		return -1;
 	}
 
 	if (fcntl(sock, F_SETFL, O_RDWR|O_NONBLOCK) < 0) {
-		error = "NS_Socket::tcp_connect_nb::fcntl:";
+		error = "NS_Socket::unix_connect_nb::fcntl:";
 		error += strerror(errno);
 		close(sock);
 		return -1;
 	}
 
-	if (af == AF_INET) {
-		if (((sockaddr_in *)from)->sin_port != 0) {
-			if (make_transparent && transparent(af, sock) < 0) {
-				error = NS_Socket::why();
-				close(sock);
-				return -1;
-			}
-			if (bind_local(sock, from, flen, 0) < 0) {
-				close(sock);
-				return -1;
-			}
-		}
-	} else if (((sockaddr_in6 *)from)->sin6_port != 0) {
-		if (make_transparent && transparent(af, sock) < 0) {
-			error = NS_Socket::why();
-			close(sock);
-			return -1;
-		}
-		if (bind_local(sock, from, flen, 0) < 0) {
-			close(sock);
-			return -1;
-		}
-	}
-
-	if (connect(sock, to, tolen) < 0 && errno != EINPROGRESS) {
-		close(sock);
-		error = "NS_Socket::tcp_connect_nb::connect:";
+	if (connect(sock, (sockaddr *)&sun, sizeof(sun)) < 0 && errno != EINPROGRESS) {
+		error = "NS_Socket::unix_connect_nb::connect:";
 		error += strerror(errno);
+		close(sock);
 		return -1;
 	}
 
@@ -249,7 +435,10 @@ int finish_connecting(int fd)
 		return -1;
 	}
 
-	return nodelay(fd);
+	// no Nagle to turn off on AF_UNIX backends
+	if (nodelay(fd) < 0 && errno != EOPNOTSUPP)
+		return -1;
+	return 0;
 }
 
 
@@ -35,6 +35,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <vector>
 
 namespace NS_Socket {
 
@@ -42,14 +43,29 @@ const char *why();
 
 int nodelay(int sock);
 
+int rcvlowat(int sock, int n);
+
 int reuse(int sock);
 
+int reuse_port(int sock);
+
+int steer_cpu(int sock, const std::vector<int> &);
+
 int transparent(int af, int sock);
 
 int dstaddr(int sock, sockaddr *, socklen_t);
 
+int tcp_socket_nb(int af, bool);
+
+int tcp_connect_on(int, const struct sockaddr *, socklen_t, const struct sockaddr *, socklen_t);
+
+ssize_t tcp_fastopen_on(int, const struct sockaddr *, socklen_t, const struct sockaddr *, socklen_t,
+                        const void *, size_t);
+
 int tcp_connect_nb(const struct sockaddr *, socklen_t, const struct sockaddr *, socklen_t, bool);
 
+int unix_connect_nb(const char *);
+
 int bind_local(int, const struct sockaddr *, socklen_t, bool);
 
 int finish_connecting(int);
@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2026 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <string>
+#include <cstring>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/bpf.h>
+#include "sockmap.h"
+
+#ifndef SO_COOKIE
+#define SO_COOKIE 57
+#endif
+
+using namespace std;
+
+
+static int bpf(int cmd, bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+
+static uint64_t cookie(int fd)
+{
+	uint64_t c = 0;
+	socklen_t len = sizeof(c);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_COOKIE, &c, &len) < 0)
+		return 0;
+	return c;
+}
+
+
+static bool tcp(int fd)
+{
+	int p = 0;
+	socklen_t len = sizeof(p);
+
+	return getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &p, &len) == 0 && p == IPPROTO_TCP;
+}
+
+
+sockmap::sockmap()
+	: map_fd(-1), peer_fd(-1), prog_fd(-1)
+{
+}
+
+
+sockmap::~sockmap()
+{
+	if (prog_fd >= 0)
+		close(prog_fd);
+	if (peer_fd >= 0)
+		close(peer_fd);
+	if (map_fd >= 0)
+		close(map_fd);
+}
+
+
+// Room for n fds. Needs CAP_BPF and CAP_NET_ADMIN (or CAP_SYS_ADMIN), so
+// call it before dropping privileges.
+int sockmap::init(uint32_t n)
+{
+	bpf_attr attr;
+
+	// fd -> socket
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_SOCKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = n;
+	if ((map_fd = bpf(BPF_MAP_CREATE, &attr)) < 0) {
+		err = "sockmap::init::bpf:";
+		err += strerror(errno);
+		return -1;
+	}
+
+	// socket cookie -> fd of peer, entries are allocated as pairs come
+	// in rather than for all n up front
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_HASH;
+	attr.key_size = sizeof(uint64_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = n;
+	attr.map_flags = BPF_F_NO_PREALLOC;
+	if ((peer_fd = bpf(BPF_MAP_CREATE, &attr)) < 0) {
+		err = "sockmap::init::bpf:";
+		err += strerror(errno);
+		return -1;
+	}
+
+	if (load() < 0)
+		return -1;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.target_fd = map_fd;
+	attr.attach_bpf_fd = prog_fd;
+	attr.attach_type = BPF_SK_SKB_VERDICT;
+	if (bpf(BPF_PROG_ATTACH, &attr) < 0) {
+		err = "sockmap::init::bpf:";
+		err += strerror(errno);
+		close(prog_fd);
+		prog_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+
+// The verdict program:
+//
+//	u64 c = bpf_get_socket_cookie(skb);
+//	u32 *peer = bpf_map_lookup_elem(&peers, &c);
+//	if (!peer)
+//		return SK_PASS;
+//	return bpf_sk_redirect_map(skb, &socks, *peer, 0);
+//
+// Sockets without a peer (yet) keep their data for recv().
+int sockmap::load()
+{
+	const bpf_insn prog[] = {
+		{BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_6, BPF_REG_1, 0, 0},
+		{BPF_JMP|BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie},
+		{BPF_STX|BPF_MEM|BPF_DW, BPF_REG_10, BPF_REG_0, -8, 0},
+		{BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_2, BPF_REG_10, 0, 0},
+		{BPF_ALU64|BPF_ADD|BPF_K, BPF_REG_2, 0, 0, -8},
+		{BPF_LD|BPF_DW|BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, peer_fd},
+		{0, 0, 0, 0, 0},
+		{BPF_JMP|BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem},
+		{BPF_JMP|BPF_JEQ|BPF_K, BPF_REG_0, 0, 7, 0},
+		{BPF_LDX|BPF_MEM|BPF_W, BPF_REG_3, BPF_REG_0, 0, 0},
+		{BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_1, BPF_REG_6, 0, 0},
+		{BPF_LD|BPF_DW|BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, map_fd},
+		{0, 0, 0, 0, 0},
+		{BPF_ALU64|BPF_MOV|BPF_K, BPF_REG_4, 0, 0, 0},
+		{BPF_JMP|BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_map},
+		{BPF_JMP|BPF_EXIT, 0, 0, 0, 0},
+		{BPF_ALU64|BPF_MOV|BPF_K, BPF_REG_0, 0, 0, SK_PASS},
+		{BPF_JMP|BPF_EXIT, 0, 0, 0, 0}
+	};
+	char log[4096];
+	bpf_attr attr;
+
+	memset(log, 0, sizeof(log));
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+	attr.insns = (unsigned long)prog;
+	attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+	attr.license = (unsigned long)"Dual BSD/GPL";
+	attr.log_buf = (unsigned long)log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+	if ((prog_fd = bpf(BPF_PROG_LOAD, &attr)) < 0) {
+		err = "sockmap::load::bpf:";
+		err += strerror(errno);
+		if (log[0]) {
+			err += ": ";
+			err += log;
+		}
+		return -1;
+	}
+	return 0;
+}
+
+
+int sockmap::update(int fd, const void *key, const void *val, string &e)
+{
+	bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = fd;
+	attr.key = (unsigned long)key;
+	attr.value = (unsigned long)val;
+	attr.flags = BPF_ANY;
+	if (bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+		e = "sockmap::update::bpf:";
+		e += strerror(errno);
+		return -1;
+	}
+	return 0;
+}
+
+
+// Redirects between TCP and AF_UNIX sockets do not work, so only TCP
+// pairs can go into the map.
+bool sockmap::tcp_pair(int a, int b)
+{
+	return tcp(a) && tcp(b);
+}
+
+
+// Relay between connected sockets a and b from now on. Both go into the
+// map before either learns its peer, so nothing is redirected to a socket
+// that is not there. Workers of all threads come here, so errors go to
+// the caller's string rather than to err.
+int sockmap::add(int a, int b, string &e)
+{
+	uint32_t ua = a, ub = b;
+	uint64_t ca = cookie(a), cb = cookie(b);
+
+	if (!active() || ca == 0 || cb == 0) {
+		e = "sockmap::add: No socket cookie.";
+		return -1;
+	}
+
+	if (!tcp_pair(a, b)) {
+		e = "sockmap::add: Not a TCP pair.";
+		return -1;
+	}
+
+	if (update(map_fd, &ua, &ua, e) < 0)
+		return -1;
+	if (update(map_fd, &ub, &ub, e) < 0 || update(peer_fd, &ca, &ub, e) < 0 ||
+	    update(peer_fd, &cb, &ua, e) < 0) {
+		del(a);
+		del(b);
+		return -1;
+	}
+	return 0;
+}
+
+
+// Forget fd before it is closed. Its map slot goes away with the socket.
+void sockmap::del(int fd)
+{
+	uint64_t c = cookie(fd);
+	bpf_attr attr;
+
+	if (!active() || c == 0)
+		return;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = peer_fd;
+	attr.key = (unsigned long)&c;
+	bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
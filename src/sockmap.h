@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2026 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef sshttp_sockmap_h
+#define sshttp_sockmap_h
+
+#include <stdint.h>
+#include <string>
+
+
+// Kernel side relaying of established socket pairs: a BPF sockmap whose
+// sk_skb verdict program sends whatever arrives on a socket out of its
+// peer, found by socket cookie. Raw bpf(2), no libbpf dependency. One
+// instance per process, as the map is indexed by fd.
+class sockmap {
+private:
+	int map_fd, peer_fd, prog_fd;
+
+	std::string err;	// init() only, add() is called from all workers
+
+	int update(int, const void *, const void *, std::string &);
+
+	int load();
+
+	sockmap(const sockmap &);
+
+	sockmap &operator=(const sockmap &);
+
+public:
+	sockmap();
+
+	~sockmap();
+
+	int init(uint32_t);
+
+	bool active()
+	{
+		return prog_fd >= 0;
+	}
+
+	bool tcp_pair(int, int);
+
+	int add(int, int, std::string &);
+
+	void del(int);
+
+	const char *why()
+	{
+		return err.c_str();
+	}
+};
+
+
+#endif
+
@@ -36,38 +36,89 @@
 #include <errno.h>
 #include <string>
 #include <cstring>
+#include <strings.h>
 #include <cstdlib>
 #include <iostream>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#ifdef USE_SOCKMAP
+#include <linux/sockios.h>
+#endif
+#ifdef LINUX26
+#include <sys/mman.h>
+#include <linux/errqueue.h>
+#endif
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <stdint.h>
+#include <syslog.h>
 #include "sshttp.h"
 #include "socket.h"
+#include "multicore.h"
 
 using namespace std;
 using namespace NS_Socket;
 
+
+volatile sig_atomic_t sshttp::stats_requested = 0;
+
 const char *sshttp::why()
 {
 	return err.c_str();
 }
 
 
-int sshttp::init(int f, const string &laddr, const string &lport, bool tproxy)
+// create a listening socket bound to ai
+int sshttp::listener(const addrinfo *ai, bool tproxy)
 {
-	af = f;
-
 	int sock_fd = socket(af, SOCK_STREAM, 0);
 	if (sock_fd < 0) {
-		err = "sshttp::init::socket:";
+		err = "sshttp::listener::socket:";
 		err += strerror(errno);
 		return -1;
 	}
 
+	// -j TPROXY
+	if (tproxy) {
+		if (transparent(af, sock_fd) < 0) {
+			err = NS_Socket::why();
+			close(sock_fd);
+			return -1;
+		}
+	}
+
+	if (af == AF_INET6) {
+		int one = 1;
+		setsockopt(sock_fd, SOL_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+	}
+
+	if (d_shards > 1 && reuse_port(sock_fd) < 0) {
+		err = NS_Socket::why();
+		close(sock_fd);
+		return -1;
+	}
+
+	if (bind_local(sock_fd, ai->ai_addr, ai->ai_addrlen, 1) < 0) {
+		err = NS_Socket::why();
+		close(sock_fd);
+		return -1;
+	}
+
+	int flags = fcntl(sock_fd, F_GETFL);
+	fcntl(sock_fd, F_SETFL, flags|O_NONBLOCK);
+
+	return sock_fd;
+}
+
+
+int sshttp::init(int f, const string &laddr, const string &lport, bool tproxy)
+{
+	af = f;
+
 	d_local_port = strtoul(lport.c_str(), NULL, 10);
 
 	int r = 0;
@@ -81,30 +132,61 @@ int sshttp::init(int f, const string &laddr, const string &lport, bool tproxy)
 		return -1;
 	}
 
-	// -j TPROXY
-	if (tproxy) {
-		if (transparent(af, sock_fd) < 0) {
-			err = NS_Socket::why();
+	// With sharding, one SO_REUSEPORT listener per worker. They are all
+	// created here, so that their order in the reuseport group is known.
+	for (int k = 0; k < (d_shards > 1 ? d_shards : 1); ++k) {
+		int fd = listener(ai, tproxy);
+		if (fd < 0) {
+			freeaddrinfo(ai);
 			return -1;
 		}
+		shards.push_back(fd);
 	}
 
-	if (af == AF_INET6) {
-		int one = 1;
-		setsockopt(sock_fd, SOL_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+	freeaddrinfo(ai);
+
+	// best effort, w/o it the kernel balances by hash
+	if (d_shards > 1) {
+		vector<int> cpus;
+		for (int k = 0; k < d_shards; ++k)
+			cpus.push_back(NS_Misc::worker_cpu(d_shard_cpu + k));
+		if (steer_cpu(shards[0], cpus) < 0)
+			syslog(LOG_INFO, "%s", NS_Socket::why());
 	}
 
-	if (bind_local(sock_fd, ai->ai_addr, ai->ai_addrlen, 1) < 0) {
-		err = NS_Socket::why();
+	return setup(shards[0]);
+}
+
+
+// Threaded workers: run on an already bound listener, typically
+// shard_fd(k) of the instance that called the other init().
+int sshttp::init(int f, const string &lport, int sock_fd)
+{
+	af = f;
+	d_local_port = strtoul(lport.c_str(), NULL, 10);
+
+	if (setup(sock_fd) < 0)
 		return -1;
+
+#ifdef LINUX26
+	// an eventfd is always writable, only POLLIN says there are pairs
+	if (d_handoff && !d_acceptor) {
+		fd2state[sock_fd].state = STATE_HANDOFF;
+		pfds[sock_fd].events = POLLIN;
 	}
+#endif
 
-	freeaddrinfo(ai);
+	// fds of the other workers are interleaved with ours
+	first_fd = 0;
+	return 0;
+}
 
-	// allocate poll array
+
+int sshttp::setup(int sock_fd)
+{
 	struct rlimit rl;
-	rl.rlim_cur = (1<<16);
-	rl.rlim_max = (1<<16);
+	rl.rlim_cur = d_fd_max;
+	rl.rlim_max = d_fd_max;
 
 	if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
 		err = "sshttp::init::setrlimit:";
@@ -112,24 +194,67 @@ int sshttp::init(int f, const string &laddr, const string &lport, bool tproxy)
 		return -1;
 	}
 
-	int flags = fcntl(sock_fd, F_GETFL);
-	fcntl(sock_fd, F_SETFL, flags|O_NONBLOCK);
-
-	pfds = new struct pollfd[rl.rlim_cur];
-	memset(pfds, 0, sizeof(struct pollfd) * rl.rlim_cur);
-
-	for (unsigned int i = 0; i < rl.rlim_cur; ++i)
-                pfds[i].fd = -1;
+	fd_limit = rl.rlim_cur;
+	if (fd_room(sock_fd) < 0)
+		return -1;
 
 	// setup listening socket for polling
+	listen_fd = sock_fd;
 	max_fd = sock_fd;
 	first_fd = sock_fd;
 	pfds[sock_fd].fd = sock_fd;
 	pfds[sock_fd].events = POLLIN|POLLOUT;
-	fd2state[sock_fd] = new struct status;
-	fd2state[sock_fd]->fd = sock_fd;
-	fd2state[sock_fd]->state = STATE_ACCEPTING;
+	fd2state[sock_fd].fd = sock_fd;
+	fd2state[sock_fd].state = STATE_ACCEPTING;
+
+	smtp_ssh_banner = "220 ";
+	smtp_ssh_banner += SMTP_DOMAIN;
+	smtp_ssh_banner += " ESMTP Postfix\n";
+	smtp_ssh_banner += SSH_BANNER;
+	smtp_ssh_banner += "\r\n";
+
+	sni2port.compile();
+	alpn2port.compile();
+	ech2port.compile();
+	host2port.compile();
+
+	// "SSH-" first, so -X rules can't steal sshd clients
+	classes = classifier();
+	classes.add("=SSH-", d_ssh_port);
+	for (size_t i = 0; i < rules.size(); ++i)
+		classes.add(rules[i].first, rules[i].second);
+	if (classes.compile() < 0) {
+		err = classes.why();
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int sshttp::shard_fd(int k)
+{
+	if (k < 0 || k >= (int)shards.size())
+		return -1;
+	return shards[k];
+}
+
 
+// After the fork, keep only the listener of worker k, under the fd
+// number of the first one.
+int sshttp::use_shard(int k)
+{
+	if (shards.size() < 2 || k < 0 || k >= (int)shards.size())
+		return 0;
+
+	if (k > 0 && dup2(shards[k], shards[0]) < 0) {
+		err = "sshttp::use_shard::dup2:";
+		err += strerror(errno);
+		return -1;
+	}
+	for (size_t j = 1; j < shards.size(); ++j)
+		close(shards[j]);
+	shards.resize(1);
 	return 0;
 }
 
@@ -139,17 +264,37 @@ void sshttp::cleanup(int fd)
 	if (fd < 0)
 		return;
 
+	// a speculative sshd connection dies with its client
+	if (fd2state[fd].state == STATE_DECIDING || fd2state[fd].state == STATE_HELLO)
+		drop_spec(fd);
+
+#ifdef USE_IO_URING
+	ring_release(fd);
+#endif
+#ifdef USE_SOCKMAP
+	offload_end(fd);
+#endif
+
 	pfds[fd].fd = -1;
 	pfds[fd].events = pfds[fd].revents = 0;
 	close(fd);
 
-	map<int, struct status *>::iterator i = fd2state.find(fd);
-	if (i != fd2state.end() && i->second) {
-		i->second->state = STATE_NONE;
-		i->second->fd = -1;
-		i->second->peer_fd = -1;
-		i->second->blen = 0;
-	}
+	status *st = &fd2state[fd];
+#ifdef LINUX26
+	if (d_handoff && !d_acceptor && st->fd >= 0)
+		d_handoff->done(d_hidx, 1);
+#endif
+	pipe_put(st);
+	data_put(st);
+	st->state = STATE_NONE;
+	st->fd = -1;
+	st->peer_fd = -1;
+	st->blen = 0;
+	st->ready = 0;
+	st->eof = 0;
+	st->guess = GUESS_NONE;
+	st->expire = 0;
+
 	if (max_fd == fd)
 		--max_fd;
 }
@@ -161,26 +306,33 @@ void sshttp::shutdown(int fd)
 {
 	if (fd < 0)
 		return;
-	if (fd2state.count(fd) == 0 || !fd2state[fd])
+	if (fd2state[fd].state == STATE_CLOSING || fd2state[fd].state == STATE_NONE)
 		return;
 
-	if (fd2state[fd]->state == STATE_CLOSING || fd2state[fd]->state == STATE_NONE)
-		return;
+#ifdef USE_IO_URING
+	ring_release(fd);
+#endif
+#ifdef USE_SOCKMAP
+	offload_end(fd);
+#endif
 
 	::shutdown(fd, SHUT_RDWR);
 
-	fd2state[fd]->state = STATE_CLOSING;
-	fd2state[fd]->blen = 0;
+	fd2state[fd].state = STATE_CLOSING;
+	pipe_put(&fd2state[fd]);
+	fd2state[fd].blen = 0;
 
 	pfds[fd].fd = -1;
 	pfds[fd].events = pfds[fd].revents = 0;
+
+	ev_timer(fd);
 }
 
 
 void sshttp::calc_max_fd()
 {
 	for (int i = max_fd; i >= first_fd; --i) {
-		if (fd2state.count(i) > 0 && fd2state[i] && fd2state[i]->state != STATE_NONE) {
+		if (fd2state[i].state != STATE_NONE) {
 			max_fd = i;
 			return;
 		}
@@ -194,24 +346,25 @@ void sshttp::calc_max_fd()
 
 int sshttp::smtp_transition(int fd)
 {
-	size_t n = 0;
+	ssize_t n = 0;
 	int peer_fd = -1;
 	sockaddr_in dst4;
 	sockaddr_in6 dst6;
-	sockaddr *dst = (sockaddr *)&dst4, *from = (sockaddr *)&fd2state[fd]->from4;
+	sockaddr *dst = (sockaddr *)&dst4, *from = (sockaddr *)&fd2state[fd].data->from4;
 	socklen_t slen = sizeof(dst4);
 
 	if (af == AF_INET6) {
 		dst = (sockaddr *)&dst6;
-		from = (sockaddr *)&fd2state[fd]->from6;
+		from = (sockaddr *)&fd2state[fd].data->from6;
 		slen = sizeof(dst6);
 	}
 
-	if (fd2state[fd]->state == STATE_BANNER_SENT) {
+	if (fd2state[fd].state == STATE_BANNER_SENT) {
 		pfds[fd].revents = 0;
 
 		// at least we want to see a 'SSH' or 'HEL'(O)
-		if ((n = read(fd, fd2state[fd]->buf, sizeof(fd2state[fd]->buf))) < 3) {
+		if (buf_reserve(&fd2state[fd]) < 0 ||
+		    (n = read(fd, fd2state[fd].data->buf, fd2state[fd].data->size)) < 3) {
 			cleanup(fd);
 			return 0;
 		}
@@ -224,47 +377,50 @@ int sshttp::smtp_transition(int fd)
 		}
 
 		// the http-port is SMTP actually in this case
-		if (strncmp(fd2state[fd]->buf, "SSH", 3) == 0)
+		if (strncmp(fd2state[fd].data->buf, "SSH", 3) == 0)
 			dst6.sin6_port = dst4.sin_port = htons(d_ssh_port);
 		else
 			dst6.sin6_port = dst4.sin_port = htons(d_http_port);
 
-		peer_fd = tcp_connect_nb(dst, slen, from, slen, 1);
+		peer_fd = backend_connect(dst, slen, from, slen);
 		if (peer_fd < 0) {
 			err = "sshttp::smtp_transition::";
 			err += NS_Socket::why();
 			cleanup(fd);
 			return -1;
 		}
-		fd2state[fd]->peer_fd = peer_fd;
-		fd2state[fd]->state = STATE_CONNECTED;
-		fd2state[fd]->last_t = now;
-		fd2state[fd]->blen = n;
-
-		if (fd2state.count(peer_fd) == 0) {
-			fd2state[peer_fd] = new (nothrow) status;
-			if (!fd2state[peer_fd]) {
-				err = "OOM";
-				cleanup(fd);
-				close(peer_fd);
-				return -1;
-			}
+		if (data_get(peer_fd) < 0) {
+			cleanup(fd);
+			close(peer_fd);
+			return -1;
 		}
 
-		fd2state[peer_fd]->fd = peer_fd;
-		fd2state[peer_fd]->peer_fd = fd;
-		fd2state[peer_fd]->state = STATE_BANNER_CONNECTING;
-		fd2state[peer_fd]->last_t = now;
+		fd2state[fd].peer_fd = peer_fd;
+		fd2state[fd].state = STATE_CONNECTED;
+		fd2state[fd].last_t = now;
+		fd2state[fd].blen = n;
+
+		fd2state[peer_fd].fd = peer_fd;
+		fd2state[peer_fd].peer_fd = fd;
+		fd2state[peer_fd].state = STATE_BANNER_CONNECTING;
+		fd2state[peer_fd].last_t = now;
+		fd2state[peer_fd].ready = 0;
+		++fd2state[peer_fd].gen;
 
 		pfds[peer_fd].fd = peer_fd;
 		// POLLIN|POLLOUT b/c we wait for connection to finish
 		pfds[peer_fd].events = POLLIN|POLLOUT;
 		pfds[peer_fd].revents = 0;
+		ev_add(peer_fd);
 
 		pfds[fd].events = POLLIN;
 		if (peer_fd > max_fd)
 			max_fd = peer_fd;
-	} else if (fd2state[fd]->state == STATE_BANNER_CONNECTING) {
+#ifdef LINUX26
+		if (d_acceptor)
+			return hand_over(fd);
+#endif
+	} else if (fd2state[fd].state == STATE_BANNER_CONNECTING) {
 		pfds[fd].revents = 0;
 
 		// special CONNECTING case, as we already sent a SMTP/SSH banner and need to
@@ -272,14 +428,14 @@ int sshttp::smtp_transition(int fd)
 		if (finish_connecting(fd) < 0) {
 			err = "sshttp::smtp_transition::";
 			err += NS_Socket::why();
-			cleanup(fd2state[fd]->peer_fd);
+			cleanup(fd2state[fd].peer_fd);
 			cleanup(fd);
 			return -1;
 		}
-		fd2state[fd]->state = STATE_BANNER_CONNECTED;
-		fd2state[fd]->last_t = now;
+		fd2state[fd].state = STATE_BANNER_CONNECTED;
+		fd2state[fd].last_t = now;
 		pfds[fd].events = POLLIN;
-	} else if (fd2state[fd]->state == STATE_BANNER_CONNECTED) {
+	} else if (fd2state[fd].state == STATE_BANNER_CONNECTED) {
 		pfds[fd].revents = 0;
 
 		// slurp in original banner, but drop it, as we already
@@ -288,12 +444,12 @@ int sshttp::smtp_transition(int fd)
 		memset(dummy, 0, sizeof(dummy));
 		n = recv(fd, dummy, sizeof(dummy) - 1, MSG_PEEK);
 		if (n < 2 || (crlf = strstr(dummy, "\r\n")) == NULL) {
-			cleanup(fd2state[fd]->peer_fd);
+			cleanup(fd2state[fd].peer_fd);
 			cleanup(fd);
 			return 0;
 		}
 		if (read(fd, dummy, crlf - dummy + 2) <= 0) {
-			cleanup(fd2state[fd]->peer_fd);
+			cleanup(fd2state[fd].peer_fd);
 			cleanup(fd);
 			return 0;
 		}
@@ -303,8 +459,8 @@ int sshttp::smtp_transition(int fd)
 
 		// once we are in normal STATE_CONNECTED, the state machine goes
 		// as normal (as with HTTP)
-		fd2state[fd]->state = STATE_CONNECTED;
-		fd2state[fd]->last_t = now;
+		fd2state[fd].state = STATE_CONNECTED;
+		fd2state[fd].last_t = now;
 	}
 
 	return 0;
@@ -312,371 +468,2422 @@ int sshttp::smtp_transition(int fd)
 }
 
 
-int sshttp::loop()
+static uint32_t buf_span(uint32_t size)
 {
-	int i = 0, afd = -1, peer_fd = -1;
-	ssize_t n = 0, wn = 0;
-	sockaddr_in sin4, dst4;
-	sockaddr_in6 sin6, dst6;
-	sockaddr *sin = (sockaddr *)&sin4, *dst = (sockaddr *)&dst4, *from = NULL;
-	socklen_t slen = sizeof(sin4);
-
-	if (af == AF_INET6) {
-		slen = sizeof(sin6);
-		sin = (struct sockaddr *)&sin6;
-		dst = (struct sockaddr *)&dst6;
-	}
-
-	string smtp_ssh_banner = "220 ";
-	smtp_ssh_banner += SMTP_DOMAIN;
-	smtp_ssh_banner += " ESMTP Postfix\n";
-	smtp_ssh_banner += SSH_BANNER;
-	smtp_ssh_banner += "\r\n";
+	static const uint32_t page = sysconf(_SC_PAGESIZE);
 
-	for (;;) {
-		// Need to have a quite small timeout, since STATE_DECIDING may change without
-		// data arrival, e.g. without a poll() trigger.
-		if (poll(pfds, max_fd + 1, 1000) < 0)
-			continue;
-
-		now = time(NULL);
+	return (size + page - 1) & ~(page - 1);
+}
 
-		// assert: pfds[i].fd == i
-		for (i = first_fd; i <= max_fd; ++i) {
 
-			if (fd2state.count(i) == 0 || !fd2state[i])
-				continue;
+// Buffers above BUF_MIN, the only ones MSG_ZEROCOPY sends from, are
+// mapped rather than malloc()ed. The kernel holds its own references to
+// the pages of a send in flight, so they can be unmapped any time and
+// the allocator never hands them out again while they are.
+static char *buf_alloc(uint32_t size)
+{
+	if (size <= BUF_MIN)
+		return (char *)malloc(size);
 
-			if (fd2state[i]->state == STATE_CLOSING) {
-				if (heavy_load || (now - fd2state[i]->last_t > TIMEOUT_CLOSING)) {
-					cleanup(i);
-					continue;
-				}
-			}
+	void *p = mmap(NULL, buf_span(size), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	return (char *)p;
+}
 
-			if (pfds[i].fd == -1)
-				continue;
 
-			// timeout hanging connections (with pending data) but not accepting socket
-			if (now - fd2state[i]->last_t >= TIMEOUT_ALIVE &&
-			    fd2state[i]->state != STATE_ACCEPTING &&
-			    fd2state[i]->blen > 0) {
-				// always cleanup()/shutdown() in pairs! Otherwise re-used fd numbers
-				// make problems
-				cleanup(fd2state[i]->peer_fd);
-				cleanup(i);
-				continue;
-			}
+static void buf_free(char *buf, uint32_t size)
+{
+	if (!buf)
+		return;
+	if (size <= BUF_MIN)
+		free(buf);
+	else
+		munmap(buf, buf_span(size));
+}
 
-			if (fd2state[i]->state == STATE_BANNER_SENT &&
-			    now - fd2state[i]->last_t >= TIMEOUT_MAILBANNER) {
-				cleanup(i);
-				continue;
-			}
 
-			if ((pfds[i].revents & (POLLERR|POLLHUP|POLLNVAL)) != 0) {
+status_table::~status_table()
+{
+	for (size_t k = 0; k < chunks.size(); ++k)
+		delete [] chunks[k];
+}
 
-				// flush buffer to peer if there is pending data
-				if (fd2state[i]->blen > 0 && fd2state[i]->state == STATE_CONNECTED) {
-					writen(fd2state[i]->peer_fd, fd2state[i]->buf, fd2state[i]->blen);
-					fd2state[i]->blen = 0;
-				}
 
-				// hangup/error for i, but let kernel flush internal send buffers
-				// for peer.
-				shutdown(fd2state[i]->peer_fd);
-				cleanup(i);
-				continue;
-			}
+// make fds up to n - 1 valid indices
+int status_table::grow(int n)
+{
+	while ((int)(chunks.size() * CHUNK) < n) {
+		status *c = new (nothrow) status[CHUNK];
+		if (!c)
+			return -1;
+		chunks.push_back(c);
+	}
+	return 0;
+}
 
-			if (pfds[i].revents == 0 && fd2state[i]->state != STATE_DECIDING)
-				continue;
 
-			// new connection ready to accept?
-			if (fd2state[i]->state == STATE_ACCEPTING) {
-				pfds[i].revents = 0;
-				for (;;) {
-					heavy_load = 0;
-#ifdef LINUX26
-					afd = accept4(i, sin, &slen, SOCK_NONBLOCK);
-#else
-					afd = accept(i, sin, &slen);
-#endif
-					if (afd < 0) {
-						if (errno == EMFILE || errno == ENFILE)
-							heavy_load = 1;
-						break;
-					}
-					nodelay(afd);
-					pfds[afd].fd = afd;
-					pfds[afd].events = POLLIN;
-					pfds[afd].revents = 0;
+// Make fd, and every fd below it, a valid index of pfds and fd2state.
+// Both grow with the highest fd in use, rather than being sized for
+// fd_limit up front.
+int sshttp::fd_room(int fd)
+{
+	if (fd < fd_cap)
+		return 0;
+	if (fd >= fd_limit) {
+		err = "sshttp::fd_room: fd above RLIMIT_NOFILE";
+		return -1;
+	}
 
-#ifndef LINUX26
-					if (fcntl(afd, F_SETFL, O_RDWR|O_NONBLOCK) < 0) {
-						cleanup(afd);
-						err = "sshttp::loop::fcntl:";
-						err += strerror(errno);
-						return -1;
-					}
-#endif
-
-					if (fd2state.count(afd) == 0) {
-						fd2state[afd] = new (nothrow) status;
-
-						if (!fd2state[afd]) {
-							err = "OOM";
-							close(afd);
-							return -1;
-						}
-					}
-
-					// We dont know yet which protocol is coming
-					fd2state[afd]->fd = afd;
-					fd2state[afd]->peer_fd = -1;
-					fd2state[afd]->state = STATE_DECIDING;
-					fd2state[afd]->from4 = sin4;
-					fd2state[afd]->from6 = sin6;
-					fd2state[afd]->last_t = now;
-
-					if (afd > max_fd)
-						max_fd = afd;
-				}
-				continue;
+	int n = fd_cap ? fd_cap : (int)status_table::CHUNK;
+	while (n <= fd)
+		n *= 2;
+	if (n > fd_limit)
+		n = fd_limit;
 
-			// First input data from a client. Now we need to decide where we go.
-			} else if (fd2state[i]->state == STATE_DECIDING) {
-
-				// special state transition if we mux SMTP/SSH
-				if (d_local_port == 25) {
-					if (writen(i, smtp_ssh_banner.c_str(), smtp_ssh_banner.size())
-					    != (ssize_t)smtp_ssh_banner.size()) {
-						cleanup(i);
-						continue;
-					}
-					pfds[i].events = POLLIN;
-					pfds[i].revents = 0;
-					fd2state[i]->state = STATE_BANNER_SENT;
-					fd2state[i]->last_t = now;
-					continue;
-				}
+	pollfd *p = (pollfd *)realloc(pfds, n * sizeof(pollfd));
+	if (!p) {
+		err = "OOM";
+		return -1;
+	}
+	for (int i = fd_cap; i < n; ++i) {
+		p[i].fd = -1;
+		p[i].events = p[i].revents = 0;
+	}
+	pfds = p;
 
-				// allow up to two seconds for clients to send first proto stuff
-				if (pfds[i].revents == 0 &&
-				    now - fd2state[i]->last_t < TIMEOUT_PROTOCOL)
-					continue;
-				pfds[i].revents = 0;
+	if (fd2state.grow(n) < 0) {
+		err = "OOM";
+		return -1;
+	}
+	fd_cap = n;
+	return 0;
+}
 
-				if (dstaddr(i, dst, slen) < 0) {
-					err = "sshttp::loop::";
-					err += NS_Socket::why();
-					cleanup(i);
-					return -1;
-				}
-				dst6.sin6_port = dst4.sin_port = htons(find_port(i));
 
-				// error?
-				if (dst4.sin_port == 0) {
-					err = "sshttp::loop: Connection reset while detecting protocol.";
-					cleanup(i);
-					return -1;
-				}
+// Buffers and addresses are only needed while a connection is open and
+// are handed out from a slab.
+int sshttp::data_get(int fd)
+{
+	if (fd_room(fd) < 0)
+		return -1;
 
-				if (af == AF_INET)
-					from = (sockaddr *)&fd2state[i]->from4;
-				else
-					from = (sockaddr *)&fd2state[i]->from6;
-				peer_fd = tcp_connect_nb(dst, slen, from, slen, 1);
+	status *st = &fd2state[fd];
+	if (st->data)
+		return 0;
 
-				if (peer_fd < 0) {
-					err = "sshttp::loop::";
-					err += NS_Socket::why();
-					cleanup(i);
-					return -1;
-				}
-				fd2state[i]->peer_fd = peer_fd;
-				fd2state[i]->state = STATE_CONNECTED;
-				fd2state[i]->last_t = now;
-
-				if (fd2state.count(peer_fd) == 0) {
-					fd2state[peer_fd] = new (nothrow) status;
-					if (!fd2state[peer_fd]) {
-						err = "OOM";
-						cleanup(i);
-						close(peer_fd);
-						return -1;
-					}
-				}
+	if (!free_data) {
+		status_data *chunk = new (nothrow) status_data[SLAB_CHUNK];
+		if (!chunk) {
+			err = "OOM";
+			return -1;
+		}
+		for (int k = 0; k < SLAB_CHUNK; ++k) {
+			chunk[k].next = free_data;
+			free_data = &chunk[k];
+		}
+	}
 
-				fd2state[peer_fd]->fd = peer_fd;
-				fd2state[peer_fd]->peer_fd = i;
-				fd2state[peer_fd]->state = STATE_CONNECTING;
-				fd2state[peer_fd]->last_t = now;
+	st->data = free_data;
+	free_data = free_data->next;
+	return 0;
+}
 
-				pfds[peer_fd].fd = peer_fd;
-				// POLLIN|POLLOUT b/c we wait for connection to finish
-				pfds[peer_fd].events = POLLOUT|POLLIN;
-				pfds[peer_fd].revents = 0;
 
-				// No POLLIN. makes no sense as long as peer hasnt
-				// finished connecting. Next state will set it to POLLIN once
-				// both peers are established and ready
-				pfds[i].events = 0;
-				if (peer_fd > max_fd)
-					max_fd = peer_fd;
+void sshttp::data_put(status *st)
+{
+	if (!st->data)
+		return;
 
-			} else if (fd2state[i]->state == STATE_CONNECTING) {
-				pfds[i].revents = 0;
+	status_data *d = st->data;
 
-				if (finish_connecting(i) < 0) {
-					err = "sshttp::loop::";
-					err += NS_Socket::why();
-					cleanup(fd2state[i]->peer_fd);
-					cleanup(i);
-					return -1;
-				}
-				fd2state[i]->state = STATE_CONNECTED;
-				fd2state[i]->last_t = now;
-				pfds[i].events = POLLIN;
-
-				// see above comment in last state when events was 0.
-				// peer is guranteed to exist, since was setup in last state
-				pfds[fd2state[i]->peer_fd].events = POLLIN;
-
-			} else if (fd2state[i]->state == STATE_CONNECTED) {
-				// peer not ready yet (may only happen in smtp case)
-				if (fd2state.count(fd2state[i]->peer_fd) == 0 ||
-				    !fd2state[fd2state[i]->peer_fd] ||
-				    fd2state[fd2state[i]->peer_fd]->state != STATE_CONNECTED) {
-					pfds[i].revents = 0;
-					continue;
-				}
+	// MSG_ZEROCOPY sends still in flight keep their pages past the
+	// munmap() below
+	d->zq.clear();
+	d->zc_len = d->zc_next = 0;
+	d->zerocopy = ZEROCOPY_NONE;
 
-				if (pfds[i].revents & POLLOUT) {
-					// actually data to send?
-					if ((n = fd2state[fd2state[i]->peer_fd]->blen) > 0) {
-						wn = writen(i, fd2state[fd2state[i]->peer_fd]->buf, n);
-
-						// error for i, but let kernel flush internal sendbuffer
-						// for peer (wn > n shouldnt really happen)
-						if (wn <= 0 || wn > n) {
-							shutdown(fd2state[i]->peer_fd);
-							cleanup(i);
-							continue;
-						}
-						// non blocking write couldnt write it all at once
-						if (wn < n) {
-							memmove(fd2state[fd2state[i]->peer_fd]->buf,
-							        fd2state[fd2state[i]->peer_fd]->buf + wn,
-							         n - wn);
-							// more pending data to send here, no need for new peer in data
-							pfds[i].events |= POLLOUT;
-							pfds[fd2state[i]->peer_fd].events &= ~POLLIN;
-						} else {
-							pfds[i].events &= ~POLLOUT;
-							// peer data was just all flushed out, so accept new data to read
-							// from peer
-							pfds[fd2state[i]->peer_fd].events |= POLLIN;
-						}
-						fd2state[fd2state[i]->peer_fd]->blen -= wn;
-					} else {
-						// no data to send, so take away from output poll for now
-						// and ask for data to read via peer
-						pfds[i].events &= ~POLLOUT;
-						pfds[fd2state[i]->peer_fd].events |= POLLIN;
-					}
-				}
+	// keep minimum sized buffers for the next connection
+	if (d->size > BUF_MIN) {
+		buf_free(d->buf, d->size);
+		d->buf = NULL;
+		d->size = 0;
+	}
+	d->head = 0;
 
-				if (pfds[i].revents & POLLIN) {
-					// still data in buffer? dont read() new data
-					if (fd2state[i]->blen > 0) {
-						pfds[i].events &= ~POLLIN;
-						pfds[fd2state[i]->peer_fd].events |= POLLOUT;
-						pfds[i].revents = 0;
-						continue;
-					}
-					n = read(i, fd2state[i]->buf, sizeof(fd2state[i]->buf));
-
-					// No need to writen() pending data on read error here, as above blen check
-					// ensured no pending data can happen here
-					if (n <= 0) {
-						shutdown(fd2state[i]->peer_fd);
-						cleanup(i);
-						continue;
-					}
-					fd2state[i]->blen = n;
-					// peer has data to write
-					pfds[i].events &= ~POLLIN;
-					pfds[fd2state[i]->peer_fd].events |= POLLOUT;
-				}
+	d->next = free_data;
+	free_data = d;
+	st->data = NULL;
+}
 
-				// if empty in-buffer, accept new input data in any case
-				if (fd2state[i]->blen == 0)
-					pfds[i].events |= POLLIN;
 
-				pfds[i].revents = 0;
-				fd2state[i]->last_t = now;
-				fd2state[fd2state[i]->peer_fd]->last_t = now;
+// Put a PROXY protocol v2 header in front of what client i sends. dst is
+// where the client connected to, port in network order.
+int sshttp::proxy_header(int i, const sockaddr *dst, uint16_t port)
+{
+	static const unsigned char sig[12] = {
+		0x0d, 0x0a, 0x0d, 0x0a, 0x00, 0x0d, 0x0a, 0x51, 0x55, 0x49, 0x54, 0x0a
+	};
+	status *st = &fd2state[i];
 
-			} else {
-				if (smtp_transition(i) < 0)
-					return -1;
-			}
-		}
-		calc_max_fd();
+	st->blen = 0;
+	if (buf_reserve(st) < 0)
+		return -1;
+	st->data->head = 0;
+
+	unsigned char *p = (unsigned char *)st->data->buf;
+	memcpy(p, sig, sizeof(sig));
+	p[12] = 0x21;		// version 2, PROXY
+	p[14] = 0;
+	if (af == AF_INET) {
+		const sockaddr_in *from = &st->data->from4, *to = (const sockaddr_in *)dst;
+		p[13] = 0x11;	// TCP over IPv4
+		p[15] = 12;
+		memcpy(p + 16, &from->sin_addr, 4);
+		memcpy(p + 20, &to->sin_addr, 4);
+		memcpy(p + 24, &from->sin_port, 2);
+		memcpy(p + 26, &port, 2);
+		st->blen = 16 + 12;
+	} else {
+		const sockaddr_in6 *from = &st->data->from6, *to = (const sockaddr_in6 *)dst;
+		p[13] = 0x21;	// TCP over IPv6
+		p[15] = 36;
+		memcpy(p + 16, &from->sin6_addr, 16);
+		memcpy(p + 32, &to->sin6_addr, 16);
+		memcpy(p + 48, &from->sin6_port, 2);
+		memcpy(p + 50, &port, 2);
+		st->blen = 16 + 36;
 	}
 	return 0;
 }
 
 
-// returns 0 on error
-uint16_t sshttp::find_port(int fd)
+#ifdef USE_SOCKMAP
+
+// Hand the pair of i over to the kernel once it is connected, both sides
+// were read up to EAGAIN and nothing of ours is left to send. We keep
+// the fds for the FIN and the timeouts.
+void sshttp::offload(int i)
 {
-	int r = 0;
-	unsigned char buf[2048 + 1] = {0};
+	status *st = &fd2state[i], *peer = &fd2state[st->peer_fd];
 
-	r = recv(fd, buf, sizeof(buf) - 1, MSG_PEEK);
+	if (!d_sockmap->active() || peer->state != STATE_CONNECTED || st->blen > 0 || peer->blen > 0 ||
+	    st->eof || peer->eof || st->guess != GUESS_NONE || peer->guess != GUESS_NONE)
+		return;
+#ifdef USE_EPOLL
+	if ((st->ready | peer->ready) & (POLLIN|EPOLLRDHUP))
+		return;
+#endif
+#ifdef USE_IO_URING
+	if (st->in_ring || peer->in_ring)
+		return;
+#endif
 
-	if ((r < 0 && errno != EAGAIN && errno != EWOULDBLOCK) || r == 0)
-		return 0;
-	// No packet (EAGAIN or EWOULDBLOCK) ? -> SSH
-	else if (r < 0)
-		return d_ssh_port;
+	// -K backends are AF_UNIX. That is no failure, they just never go.
+	if (!d_sockmap->tcp_pair(i, st->peer_fd)) {
+		st->offload = peer->offload = OFFLOAD_NEVER;
+		return;
+	}
 
-	if (memcmp(buf, "SSH-", 4) == 0)
-		return d_ssh_port;
+	if (d_sockmap->add(i, st->peer_fd, err) < 0) {
+		++stats.offload_fails;
+		st->offload = peer->offload = OFFLOAD_NEVER;
+		return;
+	}
+	++stats.offloads;
+	st->offload = peer->offload = OFFLOAD_ACTIVE;
+	pfds[i].events = pfds[st->peer_fd].events = POLLIN;
+
+	// Data that came in after the last read() but before the pair was in
+	// the map is only redirected along with the next segment. Relay it
+	// ourselves in case there is none.
+	int fds[2] = {i, st->peer_fd};
+	char c = 0;
+	for (int k = 0; k < 2; ++k) {
+		if (recv(fds[k], &c, 1, MSG_PEEK|MSG_DONTWAIT) > 0)
+			fd2state[fds[k]].ready |= POLLIN;
+	}
+}
 
-	// SNI lookup table configured? Must be https
-	if (sni2port.size() > 0) {
-		uint16_t p = https_to_port(buf, r);
-		if (p > 0)
-			return p;
 
-		// In case we found a parsing error of the ClientHello or miss the SNI, pass it
-		// to the original https port
-	}
+// i saw the FIN. What was redirected before it may still wait in the peer's
+// psock for send buffer space, so the peer is only shut down once its send
+// queue drained, or TIMEOUT_ALIVE after the FIN.
+void sshttp::offload_close(int i)
+{
+	int peer = fd2state[i].peer_fd, q = 0;
 
-	// no string match? http(s)! (https covered by HTTP_PORT)
-	return d_http_port;
+	if (ioctl(peer, SIOCOUTQ, &q) == 0 && q > 0 && now - fd2state[peer].last_t < TIMEOUT_ALIVE) {
+		fd2state[i].last_t = now;
+		return;
+	}
+	shutdown(peer);
+	cleanup(i);
 }
 
 
-// unaligned int ptr access
-uint16_t ua_uint16_ntohs(const void *vp)
+void sshttp::offload_end(int fd)
 {
-	uint16_t x = 0;
-	memcpy(&x, vp, sizeof(x));
+	if (fd2state[fd].offload == OFFLOAD_ACTIVE)
+		d_sockmap->del(fd);
+	fd2state[fd].offload = OFFLOAD_NONE;
+}
+
+#endif
+
+
+// Connect to a backend, through a prepared socket if there is one. With
+// -F, what client has sent so far goes out with the SYN and is consumed.
+// Backends on a local socket (-K) are connected directly.
+int sshttp::backend_connect(const sockaddr *dst, socklen_t dlen, const sockaddr *from, socklen_t flen, int client)
+{
+	char buf[BUF_MIN];
+	ssize_t r = 0;
+	int sock = -1;
+
+	// sin_port and sin6_port share their offset
+	uint16_t port = ntohs(((const sockaddr_in *)dst)->sin_port);
+	std::map<uint16_t, std::string>::const_iterator u = d_unix.find(port);
+	if (u != d_unix.end())
+		return unix_connect_nb(u->second.c_str());
+
+	++spare_count;
+	if (d_fastopen && client >= 0)
+		r = recv(client, buf, sizeof(buf), MSG_PEEK);
+
+	if (!spares.empty()) {
+		sock = spares.back();
+		spares.pop_back();
+		++stats.spare_hits;
+	} else {
+		if (d_spare_max > 0)
+			++stats.spare_misses;
+		if (r <= 0)
+			return tcp_connect_nb(dst, dlen, from, flen, 1);
+		if ((sock = tcp_socket_nb(af, 1)) < 0)
+			return -1;
+	}
+
+	if (r <= 0)
+		return tcp_connect_on(sock, dst, dlen, from, flen);
+
+	ssize_t n = tcp_fastopen_on(sock, dst, dlen, from, flen, buf, r);
+	if (n < 0)
+		return -1;
+	if (n > 0) {
+		++stats.tfo_sent;
+		recv(client, buf, n, 0);
+	} else
+		++stats.tfo_fallbacks;
+	return sock;
+}
+
+
+// Keep about 1/8s worth of backend connects prepared, at most
+// d_spare_max. None while we are short of fds.
+void sshttp::spare_fill()
+{
+	if (now - spare_t >= 1000) {
+		spare_rate = (spare_rate + spare_count * 1000 / (now - spare_t)) / 2;
+		spare_count = 0;
+		spare_t = now;
+	}
+
+	size_t want = (spare_rate + 7) / 8;
+	if (want > d_spare_max)
+		want = d_spare_max;
+	if (heavy_load)
+		want = 0;
+
+	for (; spares.size() > want; spares.pop_back())
+		close(spares.back());
+
+	for (int k = 0; spares.size() < want && k < SPARE_REFILL; ++k) {
+		int sock = tcp_socket_nb(af, 1);
+		if (sock < 0)
+			break;
+		spares.push_back(sock);
+	}
+}
+
+
+// Pipes for splice() are only held while data is in flight and are
+// otherwise kept in a pool.
+int sshttp::pipe_get(status *st)
+{
+#ifdef LINUX26
+	if (st->pipefd[0] >= 0)
+		return 0;
+
+	if (pipes.size() >= 2) {
+		st->pipefd[1] = pipes.back();
+		pipes.pop_back();
+		st->pipefd[0] = pipes.back();
+		pipes.pop_back();
+		return 0;
+	}
+
+	if (pipe2(st->pipefd, O_NONBLOCK|O_CLOEXEC) < 0) {
+		st->pipefd[0] = st->pipefd[1] = -1;
+		return -1;
+	}
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+
+void sshttp::pipe_put(status *st)
+{
+	if (st->pipefd[0] < 0)
+		return;
+
+	// a pipe with data left in it cannot be reused
+	if (st->blen > 0 || pipes.size() >= 2 * PIPE_POOL_MAX) {
+		close(st->pipefd[0]);
+		close(st->pipefd[1]);
+	} else {
+		pipes.push_back(st->pipefd[0]);
+		pipes.push_back(st->pipefd[1]);
+	}
+	st->pipefd[0] = st->pipefd[1] = -1;
+}
+
+
+// Make room in the relay buffer of st: allocate it on first use and
+// double its size when it is full, up to d_buf_max.
+int sshttp::buf_reserve(status *st)
+{
+	status_data *d = st->data;
+	uint32_t size = 0;
+
+	if (!d->buf && !bufs.empty()) {
+		d->buf = bufs.back();
+		d->size = BUF_MIN;
+		d->head = 0;
+		bufs.pop_back();
+		return 0;
+	} else if (!d->buf)
+		size = BUF_MIN;
+	else if (st->blen == d->size && d->size < d_buf_max)
+		size = d->size * 2 < d_buf_max ? d->size * 2 : d_buf_max;
+	else
+		return 0;
+
+	char *nb = buf_alloc(size);
+	if (!nb) {
+		err = "OOM";
+		return -1;
+	}
+
+	// linearize pending data
+	if (d->buf) {
+		uint32_t first = d->size - d->head;
+		if (first > st->blen)
+			first = st->blen;
+		memcpy(nb, d->buf + d->head, first);
+		memcpy(nb + first, d->buf, st->blen - first);
+		buf_free(d->buf, d->size);
+	}
+	d->buf = nb;
+	d->size = size;
+	d->head = 0;
+	return 0;
+}
+
+
+// Nothing buffered for st and its fd drained: an idle session needs no
+// buffer until it has data again, so take it back into the pool.
+void sshttp::buf_idle(status *st)
+{
+	status_data *d = st->data;
+
+	if (st->blen > 0 || !d || !d->buf || d->size != BUF_MIN || d->zc_len > 0)
+		return;
+	if (bufs.size() < BUF_POOL_MAX)
+		bufs.push_back(d->buf);
+	else
+		free(d->buf);
+	d->buf = NULL;
+	d->size = 0;
+	d->head = 0;
+}
+
+
+// no more room to read into for st's fd until the peer took some
+bool sshttp::relay_full(const status *st)
+{
+	// pipes are only refilled once empty
+	if (st->pipefd[0] >= 0)
+		return st->blen > 0;
+	if (!st->data || !st->data->buf)
+		return 0;
+	// space the kernel still sends from comes back with zerocopy_done()
+	if (st->data->zc_len > 0)
+		return st->blen + st->data->zc_len >= st->data->size;
+	return st->blen >= st->data->size && st->data->size >= d_buf_max;
+}
+
+
+// Read from fd into the ring buffer of st, or with splice mode into a pipe,
+// and account it in st->blen. want is set to the amount that was asked for,
+// or to 0 if a short read does not mean that fd is drained.
+ssize_t sshttp::relay_read(int fd, status *st, size_t &want)
+{
+	ssize_t r = 0;
+
+#ifdef LINUX26
+	// if no pipe can be had (EMFILE), go with the buffer. Data that is
+	// already buffered has to go out first though.
+	if (d_splice && (st->pipefd[0] >= 0 || st->blen == 0) && pipe_get(st) == 0) {
+		// a splice stops early once the pipe is full, with more
+		// data still queued on fd
+		want = 0;
+		r = splice(fd, NULL, st->pipefd[1], NULL, SPLICE_CHUNK, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (r <= 0)
+			pipe_put(st);
+		else
+			st->blen += r;
+		return r;
+	}
+#endif
+
+	if (buf_reserve(st) < 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	status_data *d = st->data;
+
+	// start at the front if empty, so small flows use one segment
+	if (st->blen == 0 && d->zc_len == 0)
+		d->head = 0;
+
+	// what zerocopy sends still use, right before head, is not ours
+	uint32_t start = (d->head + d->size - d->zc_len) % d->size, used = st->blen + d->zc_len;
+	uint32_t tail = (d->head + st->blen) % d->size;
+	iovec iov[2];
+	int cnt = 1;
+
+	iov[0].iov_base = d->buf + tail;
+	if (tail >= start && used < d->size) {
+		iov[0].iov_len = d->size - tail;
+		iov[1].iov_base = d->buf;
+		iov[1].iov_len = start;
+		if (start > 0)
+			cnt = 2;
+	} else
+		iov[0].iov_len = start - tail;
+
+	want = d->size - used;
+	if ((r = readv(fd, iov, cnt)) <= 0)
+		return r;
+
+	// a small read into an empty buffer: flow is not bulk (anymore),
+	// so shrink back to the minimum
+	if (used == 0 && r < BUF_MIN && d->size > BUF_MIN) {
+		char *nb = buf_alloc(BUF_MIN);
+		if (nb) {
+			memcpy(nb, d->buf, r);
+			buf_free(d->buf, d->size);
+			d->buf = nb;
+			d->size = BUF_MIN;
+		}
+	}
+
+	st->blen += r;
+	return r;
+}
+
+
+// Write up to n pending bytes of src to fd and remove them from src.
+// Returns 0 if fd would block.
+ssize_t sshttp::relay_write(int fd, status *src, size_t n)
+{
+	ssize_t r = 0, o = 0;
+
+	if (n > src->blen)
+		n = src->blen;
+
+	// client heard from a guessed backend, too late to re-route
+	if (n > 0 && fd2state[fd].guess == GUESS_PENDING)
+		fd2state[fd].guess = GUESS_SENT;
+
+#ifdef LINUX26
+	if (src->pipefd[0] >= 0) {
+		while (n > 0) {
+			if ((r = splice(src->pipefd[0], NULL, fd, NULL, n, SPLICE_F_MOVE|SPLICE_F_NONBLOCK)) <= 0)
+				break;
+			n -= r;
+			o += r;
+		}
+		src->blen -= o;
+		if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			return r;
+		return o;
+	}
+#endif
+
+	status_data *d = src->data;
+
+	while (n > 0) {
+		iovec iov[2];
+		int cnt = 1;
+
+		iov[0].iov_base = d->buf + d->head;
+		iov[0].iov_len = d->size - d->head;
+		if (iov[0].iov_len >= n)
+			iov[0].iov_len = n;
+		else {
+			iov[1].iov_base = d->buf;
+			iov[1].iov_len = n - iov[0].iov_len;
+			cnt = 2;
+		}
+
+#ifdef LINUX26
+		bool zc = zerocopy(fd, src, n);
+		if (zc) {
+			msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = cnt;
+			// out of optmem for notifications
+			if ((r = sendmsg(fd, &msg, MSG_ZEROCOPY)) < 0 && errno == ENOBUFS) {
+				zc = 0;
+				r = writev(fd, iov, cnt);
+			}
+		} else
+#endif
+		r = writev(fd, iov, cnt);
+		if (r <= 0)
+			break;
+
+#ifdef LINUX26
+		// space is given back in send order, so whatever follows a
+		// zerocopy send waits for it
+		if (zc || !d->zq.empty()) {
+			zc_send z = {zc ? d->zc_next++ : 0, (uint32_t)r, !zc};
+			d->zq.push_back(z);
+			d->zc_len += r;
+			if (zc)
+				++stats.zc_sends;
+		}
+#endif
+		d->head = (d->head + r) % d->size;
+		src->blen -= r;
+		n -= r;
+		o += r;
+	}
+
+	if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		return r;
+	return o;
+}
+
+
+#ifdef LINUX26
+// Whether to send n bytes of src to fd with MSG_ZEROCOPY. Only flows whose
+// buffer grew to the maximum are bulk enough to pay for the pinning and
+// the notifications.
+bool sshttp::zerocopy(int fd, const status *src, size_t n)
+{
+	if (!d_zerocopy || n < ZEROCOPY_MIN || src->data->size < d_buf_max)
+		return 0;
+#ifdef USE_IO_URING
+	// ring polls do not expect the POLLERR of completions
+	if (ring)
+		return 0;
+#endif
+
+	status_data *d = fd2state[fd].data;
+	if (!d)
+		return 0;
+	if (d->zerocopy == ZEROCOPY_NONE) {
+		int one = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+			d->zerocopy = ZEROCOPY_ON;
+		else
+			d->zerocopy = ZEROCOPY_OFF;
+	}
+	return d->zerocopy == ZEROCOPY_ON;
+}
+
+
+// Read the completions of MSG_ZEROCOPY sends to i from its error queue and
+// give the buffer space of its peer back. Returns -1 if i has a real
+// error as well.
+int sshttp::zerocopy_done(int i)
+{
+	status *st = &fd2state[i], *peer = &fd2state[st->peer_fd];
+	status_data *d = peer->data;
+
+	for (;;) {
+		char cbuf[128];
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		if (recvmsg(i, &msg, MSG_ERRQUEUE) < 0)
+			break;
+
+		for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				continue;
+			const sock_extended_err *ee = (const sock_extended_err *)CMSG_DATA(cm);
+			if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			// ids ee_info to ee_data are done
+			uint32_t lo = ee->ee_info, cnt = ee->ee_data - lo;
+			for (size_t k = 0; d && k < d->zq.size(); ++k) {
+				if (d->zq[k].id - lo <= cnt)
+					d->zq[k].done = 1;
+			}
+
+			// loopback, or a NIC that cannot gather: the kernel
+			// copied after all, so do not bother anymore
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				st->data->zerocopy = ZEROCOPY_OFF;
+				stats.zc_copied += cnt + 1;
+			}
+		}
+	}
+
+	while (d && !d->zq.empty() && d->zq.front().done) {
+		d->zc_len -= d->zq.front().len;
+		d->zq.erase(d->zq.begin());
+	}
+
+	// room again to read from peer
+	if (!relay_full(peer) && !peer->eof)
+		pfds[st->peer_fd].events |= POLLIN;
+
+	int e = 0;
+	socklen_t elen = sizeof(e);
+	if (getsockopt(i, SOL_SOCKET, SO_ERROR, &e, &elen) < 0 || e != 0)
+		return -1;
+	return 0;
+}
+#endif
+
+
+void sshttp::log_stats()
+{
+	stats_seen = stats_requested;
+	syslog(LOG_INFO, "relay: %llu drain events, %llu reads, %llu bytes, budget exhausted %llu times",
+	       (unsigned long long)stats.drain_events, (unsigned long long)stats.reads,
+	       (unsigned long long)stats.bytes, (unsigned long long)stats.budget_exhausted);
+	string h = "";
+	char b[64];
+	for (int k = 0; k < FIRST_BYTE_BUCKETS; ++k) {
+		snprintf(b, sizeof(b), " <%dms %llu,", 1<<k, (unsigned long long)stats.first_byte[k]);
+		h += b;
+	}
+	syslog(LOG_INFO, "first byte:%s later %llu, silent %llu", h.c_str(),
+	       (unsigned long long)stats.late, (unsigned long long)stats.silent);
+	if (d_preconnect)
+		syslog(LOG_INFO, "preconnect: %llu used, %llu dropped",
+		       (unsigned long long)stats.spec_used, (unsigned long long)stats.spec_dropped);
+	if (d_fastopen)
+		syslog(LOG_INFO, "fast open: %llu first flights sent with SYN, %llu fallbacks",
+		       (unsigned long long)stats.tfo_sent, (unsigned long long)stats.tfo_fallbacks);
+#ifdef USE_SOCKMAP
+	if (d_sockmap)
+		syslog(LOG_INFO, "sockmap: %llu pairs offloaded, %llu failed",
+		       (unsigned long long)stats.offloads, (unsigned long long)stats.offload_fails);
+#endif
+	if (d_zerocopy)
+		syslog(LOG_INFO, "zerocopy: %llu sends, %llu copied by the kernel",
+		       (unsigned long long)stats.zc_sends, (unsigned long long)stats.zc_copied);
+	if (d_spare_max > 0)
+		syslog(LOG_INFO, "spare sockets: %llu hits, %llu misses, %zu ready",
+		       (unsigned long long)stats.spare_hits, (unsigned long long)stats.spare_misses,
+		       spares.size());
+	if (tls_routes())
+		syslog(LOG_INFO, "TLS: %llu split ClientHellos waited for, %llu timed out",
+		       (unsigned long long)stats.hellos, (unsigned long long)stats.hello_timeouts);
+	if (history.enabled())
+		syslog(LOG_INFO, "history: %llu SSH guesses, %llu wrong",
+		       (unsigned long long)stats.guesses, (unsigned long long)stats.misguesses);
+#ifdef LINUX26
+	if (d_acceptor)
+		syslog(LOG_INFO, "acceptor %d: %llu pairs handed off, %llu dropped", d_hidx,
+		       (unsigned long long)stats.handoffs, (unsigned long long)stats.handoff_drops);
+	else if (d_handoff)
+		syslog(LOG_INFO, "relay %d: %llu pairs taken over", d_hidx,
+		       (unsigned long long)stats.handoffs);
+#endif
+}
+
+
+// when clients sent their first bytes after accept, to pick -w
+void sshttp::first_byte(uint64_t ms)
+{
+	int k = 0;
+	while (k < FIRST_BYTE_BUCKETS && ms >= (1ULL<<k))
+		++k;
+	if (k < FIRST_BYTE_BUCKETS)
+		++stats.first_byte[k];
+	else
+		++stats.late;
+}
+
+
+// setup a freshly accepted client connection
+int sshttp::accepted(int afd, const sockaddr_in &sin4, const sockaddr_in6 &sin6)
+{
+	nodelay(afd);
+
+#ifndef LINUX26
+	if (fcntl(afd, F_SETFL, O_RDWR|O_NONBLOCK) < 0) {
+		close(afd);
+		err = "sshttp::accepted::fcntl:";
+		err += strerror(errno);
+		return -1;
+	}
+#endif
+
+	if (data_get(afd) < 0) {
+		close(afd);
+		return -1;
+	}
+
+	// We dont know yet which protocol is coming
+	fd2state[afd].fd = afd;
+	fd2state[afd].peer_fd = -1;
+	fd2state[afd].state = STATE_DECIDING;
+	fd2state[afd].data->from4 = sin4;
+	fd2state[afd].data->from6 = sin6;
+	fd2state[afd].last_t = now;
+	fd2state[afd].ready = 0;
+	++fd2state[afd].gen;
+
+	pfds[afd].fd = afd;
+	// in SMTP mode we talk first
+	pfds[afd].events = (d_local_port == 25) ? POLLOUT : POLLIN;
+	pfds[afd].revents = 0;
+	ev_add(afd);
+	ev_timer(afd);
+
+	if (afd > max_fd)
+		max_fd = afd;
+
+	if (d_preconnect && d_local_port != 25 && !proxied(d_ssh_port))
+		preconnect(afd);
+
+	// A client that went to SSH last time and did not send anything yet
+	// is most likely waiting for the banner, so decide right away.
+	// verify() corrects it if it speaks first after all.
+	if (d_local_port != 25 && history.enabled()) {
+		const sockaddr *from = (const sockaddr *)&sin4;
+		if (af == AF_INET6)
+			from = (const sockaddr *)&sin6;
+		char c = 0;
+		if (history.get(from) == d_ssh_port && recv(afd, &c, 1, MSG_PEEK) < 0 &&
+		    (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			fd2state[afd].guess = GUESS_PENDING;
+			return process(afd);
+		}
+	}
+
+	return 0;
+}
+
+
+// when the current state of a connection times out, 0 if never
+uint64_t sshttp::deadline(const status *st)
+{
+	uint64_t d = 0;
+
+	switch (st->state) {
+	case STATE_DECIDING:
+		d = st->last_t + d_protocol_ms;
+		break;
+	case STATE_BANNER_SENT:
+		d = st->last_t + d_banner_ms;
+		break;
+	case STATE_HELLO:
+		d = st->last_t + TIMEOUT_HELLO;
+		break;
+	case STATE_CLOSING:
+		return st->last_t + TIMEOUT_CLOSING + 1;
+	case STATE_ACCEPTING:
+	case STATE_HANDOFF:
+	case STATE_SPEC_CONNECTING:
+	case STATE_SPEC_CONNECTED:
+	case STATE_NONE:
+		return 0;
+	default:
+		break;
+	}
+
+#ifdef USE_SOCKMAP
+	if (st->offload == OFFLOAD_ACTIVE && st->eof)
+		d = st->last_t + TIMEOUT_LINGER;
+#endif
+
+	// hanging connections with pending data
+	if (st->blen > 0 && (d == 0 || st->last_t + TIMEOUT_ALIVE < d))
+		d = st->last_t + TIMEOUT_ALIVE;
+	return d;
+}
+
+
+// Arm the timer of fd for its current deadline. Timers are not moved when
+// last_t changes; an early timer just re-arms for the new deadline when it
+// fires.
+void sshttp::ev_timer(int fd)
+{
+	if (fd < 0)
+		return;
+
+	status *st = &fd2state[fd];
+	uint64_t d = deadline(st);
+	if (d == 0 || (st->expire != 0 && st->expire <= d))
+		return;
+
+	st->expire = d;
+	timers.add(fd, st->gen, d);
+}
+
+
+// Run the expired timers. The poll() loop walks all fds anyway, so there
+// they are just disarmed.
+int sshttp::ev_expire()
+{
+	expired.clear();
+	timers.advance(now, expired);
+
+	for (size_t k = 0; k < expired.size(); ++k) {
+		const timer_wheel::entry &e = expired[k];
+		status *st = &fd2state[e.fd];
+
+		// cancelled or re-armed
+		if (st->gen != e.gen || st->expire != e.expire)
+			continue;
+		st->expire = 0;
+
+#ifdef USE_EPOLL
+		int peer = st->peer_fd;
+		pfds[e.fd].revents = 0;
+		int r = process(e.fd);
+
+		ev_timer(e.fd);
+		ev_timer(peer);
+		ev_queue(e.fd);
+		ev_queue(peer);
+
+		if (r < 0) {
+			for (++k; k < expired.size(); ++k)
+				timers.add(expired[k].fd, expired[k].gen, expired[k].expire);
+			return -1;
+		}
+#endif
+	}
+	return 0;
+}
+
+
+#ifdef LINUX26
+
+// forget about fd without closing it, it belongs to another thread now
+void sshttp::detach(int fd)
+{
+	ev_del(fd);
+	pfds[fd].fd = -1;
+	pfds[fd].events = pfds[fd].revents = 0;
+
+	status *st = &fd2state[fd];
+	data_put(st);
+	st->state = STATE_NONE;
+	st->fd = -1;
+	st->peer_fd = -1;
+	st->blen = 0;
+	st->ready = 0;
+	st->eof = 0;
+	st->guess = GUESS_NONE;
+	st->expire = 0;
+	++st->gen;
+
+	if (max_fd == fd)
+		--max_fd;
+}
+
+
+// Acceptor: the pair is decided and the backend is connecting, a relay
+// thread takes it from here.
+int sshttp::hand_over(int fd)
+{
+	status *st = &fd2state[fd];
+	handoff::item h;
+
+	memset(&h, 0, sizeof(h));
+	h.fd = fd;
+	h.peer_fd = st->peer_fd;
+	h.state = st->state;
+	h.peer_state = fd2state[h.peer_fd].state;
+	h.events = pfds[fd].events;
+	h.peer_events = pfds[h.peer_fd].events;
+
+	// SMTP mode already read the first client bytes, or a PROXY
+	// header is waiting
+	if (st->blen > 0) {
+		h.buf = st->data->buf;
+		h.size = st->data->size;
+		h.head = st->data->head;
+		h.blen = st->blen;
+		st->data->buf = NULL;
+		st->data->size = 0;
+	}
+
+	detach(h.peer_fd);
+	detach(fd);
+
+	if (d_handoff->push(d_hidx, h) < 0) {
+		++stats.handoff_drops;
+		buf_free(h.buf, h.size);
+		close(h.peer_fd);
+		close(fd);
+		return 0;
+	}
+	++stats.handoffs;
+	return 0;
+}
+
+
+// Relay thread: set up a pair as if we had decided it ourself.
+int sshttp::adopt(const handoff::item &h)
+{
+	if (data_get(h.fd) < 0 || data_get(h.peer_fd) < 0) {
+		if (h.fd < fd_cap)
+			data_put(&fd2state[h.fd]);
+		buf_free(h.buf, h.size);
+		close(h.fd);
+		close(h.peer_fd);
+		d_handoff->done(d_hidx, 2);
+		return -1;
+	}
+
+	for (int k = 0; k < 2; ++k) {
+		int fd = k ? h.peer_fd : h.fd;
+		status *st = &fd2state[fd];
+
+		st->fd = fd;
+		st->peer_fd = k ? h.fd : h.peer_fd;
+		st->state = (status_t)(k ? h.peer_state : h.state);
+		st->last_t = now;
+		st->blen = 0;
+		st->ready = 0;
+		st->eof = 0;
+		++st->gen;
+
+		pfds[fd].fd = fd;
+		pfds[fd].events = k ? h.peer_events : h.events;
+		pfds[fd].revents = 0;
+		if (fd > max_fd)
+			max_fd = fd;
+	}
+
+	if (h.buf) {
+		status_data *d = fd2state[h.fd].data;
+		buf_free(d->buf, d->size);
+		d->buf = h.buf;
+		d->size = h.size;
+		d->head = h.head;
+		fd2state[h.fd].blen = h.blen;
+	}
+
+	ev_add(h.fd);
+	ev_add(h.peer_fd);
+	ev_timer(h.fd);
+	ev_timer(h.peer_fd);
+
+#ifdef USE_IO_URING
+	// preconnected sshd, both ends are established already
+	if (ring && h.state == STATE_CONNECTED && h.peer_state == STATE_CONNECTED)
+		ring_start(h.peer_fd);
+#endif
+	++stats.handoffs;
+	return 0;
+}
+
+
+// Relay thread: the eventfd of our inbox fired. It is drained before the
+// queues, so that a push racing with us signals again.
+int sshttp::inbox(int fd)
+{
+	uint64_t n = 0;
+	int r = 0;
+
+	// a single read resets the counter
+	if (read(fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+		err = "sshttp::inbox::read:";
+		err += strerror(errno);
+		return -1;
+	}
+	ev_drained(fd, POLLIN);
+
+	handoff::item h;
+	while (d_handoff->pop(d_hidx, h)) {
+		if (adopt(h) < 0)
+			r = -1;
+	}
+	return r;
+}
+
+#endif
+
+
+// Start connecting to sshd for a client that is still deciding, so that
+// SSH clients do not wait for that connect too. Whatever sshd sends is
+// left in the socket until the client turned out to be SSH. Best effort.
+void sshttp::preconnect(int afd)
+{
+	sockaddr_in dst4;
+	sockaddr_in6 dst6;
+	sockaddr *dst = (sockaddr *)&dst4, *from = (sockaddr *)&fd2state[afd].data->from4;
+	socklen_t slen = sizeof(dst4);
+
+	if (af == AF_INET6) {
+		dst = (sockaddr *)&dst6;
+		from = (sockaddr *)&fd2state[afd].data->from6;
+		slen = sizeof(dst6);
+	}
+
+	if (dstaddr(afd, dst, slen) < 0)
+		return;
+	dst6.sin6_port = dst4.sin_port = htons(d_ssh_port);
+
+	int b = backend_connect(dst, slen, from, slen);
+	if (b < 0)
+		return;
+	if (data_get(b) < 0) {
+		close(b);
+		return;
+	}
+
+	fd2state[afd].peer_fd = b;
+
+	fd2state[b].fd = b;
+	fd2state[b].peer_fd = afd;
+	fd2state[b].state = STATE_SPEC_CONNECTING;
+	fd2state[b].last_t = now;
+	fd2state[b].ready = 0;
+	++fd2state[b].gen;
+
+	pfds[b].fd = b;
+	pfds[b].events = POLLOUT;
+	pfds[b].revents = 0;
+	ev_add(b);
+
+	if (b > max_fd)
+		max_fd = b;
+}
+
+
+// events on a preconnected sshd socket while its client is deciding
+void sshttp::speculating(int b)
+{
+	status *st = &fd2state[b];
+	short rev = pfds[b].revents;
+
+	pfds[b].revents = 0;
+
+	if ((rev & (POLLERR|POLLHUP|POLLNVAL)) == 0) {
+		if (st->state == STATE_SPEC_CONNECTED || (rev & POLLOUT) == 0)
+			return;
+		if (finish_connecting(b) == 0) {
+			// hold whatever sshd says
+			st->state = STATE_SPEC_CONNECTED;
+			pfds[b].events = 0;
+			return;
+		}
+	}
+
+	// didnt work out, the client gets a fresh connection if it is SSH
+	drop_spec(st->peer_fd);
+}
+
+
+void sshttp::drop_spec(int i)
+{
+	int b = fd2state[i].peer_fd;
+
+	if (b < 0)
+		return;
+
+	fd2state[i].peer_fd = -1;
+	++stats.spec_dropped;
+	cleanup(b);
+}
+
+
+// Client i is SSH and its sshd connection is already there, the held
+// banner goes out as soon as it is relayed as usual.
+void sshttp::use_spec(int i)
+{
+	int b = fd2state[i].peer_fd;
+
+	++stats.spec_used;
+
+	fd2state[i].state = STATE_CONNECTED;
+	fd2state[i].last_t = now;
+	fd2state[b].last_t = now;
+
+	if (fd2state[b].state == STATE_SPEC_CONNECTED) {
+		fd2state[b].state = STATE_CONNECTED;
+		pfds[b].events = POLLIN;
+		pfds[i].events = POLLIN;
+#ifdef USE_IO_URING
+		if (ring && fd2state[i].guess == GUESS_NONE)
+			ring_start(b);
+#endif
+	} else {
+		fd2state[b].state = STATE_CONNECTING;
+		pfds[b].events = POLLOUT|POLLIN;
+		pfds[i].events = 0;
+	}
+}
+
+
+// The backend of client i was guessed from the history. Once the client
+// sends something, confirm or correct the guess. Returns 1 if i was
+// re-routed or closed, -1 on error.
+int sshttp::verify(int i)
+{
+	status *st = &fd2state[i];
+	char c = 0;
+
+	// find_port() would take silence for SSH
+	if (recv(i, &c, 1, MSG_PEEK) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+
+	int port = find_port(i, 0);
+
+	// right, or EOF/error which the relay code deals with
+	if (port == 0 || port == d_ssh_port) {
+		st->guess = GUESS_NONE;
+#ifdef USE_IO_URING
+		if (ring && st->blen == 0 && fd2state[st->peer_fd].blen == 0)
+			ring_start(i);
+#endif
+		return 0;
+	}
+
+	++stats.misguesses;
+	if (af == AF_INET)
+		history.put((sockaddr *)&st->data->from4, port);
+	else
+		history.put((sockaddr *)&st->data->from6, port);
+
+	// already talked to the client on behalf of sshd
+	if (st->guess == GUESS_SENT) {
+		cleanup(st->peer_fd);
+		cleanup(i);
+		return 1;
+	}
+
+	// nothing relayed yet, start over with the right backend
+	cleanup(st->peer_fd);
+	st->peer_fd = -1;
+	st->blen = 0;
+	st->guess = GUESS_NONE;
+	st->state = STATE_DECIDING;
+	pfds[i].events = POLLIN;
+	pfds[i].revents = POLLIN;
+	return process(i) < 0 ? -1 : 1;
+}
+
+
+int sshttp::process(int i)
+{
+	int afd = -1, peer_fd = -1;
+	ssize_t n = 0, wn = 0;
+	sockaddr_in sin4, dst4;
+	sockaddr_in6 sin6, dst6;
+	sockaddr *sin = (sockaddr *)&sin4, *dst = (sockaddr *)&dst4, *from = NULL;
+	socklen_t slen = sizeof(sin4);
+
+	if (af == AF_INET6) {
+		slen = sizeof(sin6);
+		sin = (struct sockaddr *)&sin6;
+		dst = (struct sockaddr *)&dst6;
+	}
+
+	if (fd2state[i].state == STATE_CLOSING) {
+		if (heavy_load || (now - fd2state[i].last_t > TIMEOUT_CLOSING)) {
+			cleanup(i);
+			return 0;
+		}
+	}
+
+	if (pfds[i].fd == -1)
+		return 0;
+
+	if (fd2state[i].state == STATE_SPEC_CONNECTING || fd2state[i].state == STATE_SPEC_CONNECTED) {
+		speculating(i);
+		return 0;
+	}
+
+#ifdef USE_SOCKMAP
+	if (fd2state[i].offload == OFFLOAD_ACTIVE && fd2state[i].eof && now - fd2state[i].last_t >= TIMEOUT_LINGER) {
+		offload_close(i);
+		return 0;
+	}
+#endif
+
+	// timeout hanging connections (with pending data) but not accepting socket
+	if (now - fd2state[i].last_t >= TIMEOUT_ALIVE &&
+	    fd2state[i].state != STATE_ACCEPTING &&
+	    fd2state[i].blen > 0) {
+		// always cleanup()/shutdown() in pairs! Otherwise re-used fd numbers
+		// make problems
+		cleanup(fd2state[i].peer_fd);
+		cleanup(i);
+		return 0;
+	}
+
+	if (fd2state[i].state == STATE_BANNER_SENT &&
+	    now - fd2state[i].last_t >= d_banner_ms) {
+		cleanup(i);
+		return 0;
+	}
+
+	// AF_UNIX backends hang up right when they close, even with data
+	// still queued for us. Read that up to EOF as after a TCP FIN.
+	int unread = 0;
+	if ((pfds[i].revents & (POLLERR|POLLHUP|POLLNVAL)) == POLLHUP &&
+	    fd2state[i].state == STATE_CONNECTED && ioctl(i, FIONREAD, &unread) == 0 && unread > 0) {
+		pfds[i].revents &= ~POLLHUP;
+		ev_drained(i, POLLHUP);
+	}
+
+#ifdef LINUX26
+	// completions of MSG_ZEROCOPY sends to i
+	if ((pfds[i].revents & POLLERR) && fd2state[i].state == STATE_CONNECTED &&
+	    fd2state[i].data && fd2state[i].data->zerocopy != ZEROCOPY_NONE && zerocopy_done(i) == 0) {
+		pfds[i].revents &= ~POLLERR;
+		ev_drained(i, POLLERR);
+	}
+#endif
+
+	if ((pfds[i].revents & (POLLERR|POLLHUP|POLLNVAL)) != 0) {
+
+		// flush buffer to peer if there is pending data
+		if (fd2state[i].blen > 0 && fd2state[i].state == STATE_CONNECTED) {
+			relay_write(fd2state[i].peer_fd, &fd2state[i], fd2state[i].blen);
+			fd2state[i].blen = 0;
+			pipe_put(&fd2state[i]);
+		}
+
+		// hangup/error for i, but let kernel flush internal send buffers
+		// for peer.
+		shutdown(fd2state[i].peer_fd);
+		cleanup(i);
+		return 0;
+	}
+
+	if (pfds[i].revents == 0 && fd2state[i].state != STATE_DECIDING &&
+	    fd2state[i].state != STATE_HELLO)
+		return 0;
+
+	// new connection ready to accept?
+	if (fd2state[i].state == STATE_ACCEPTING) {
+		pfds[i].revents = 0;
+		for (;;) {
+			heavy_load = 0;
+#ifdef LINUX26
+			afd = accept4(i, sin, &slen, SOCK_NONBLOCK);
+#else
+			afd = accept(i, sin, &slen);
+#endif
+			if (afd < 0) {
+				if (errno == EMFILE || errno == ENFILE)
+					heavy_load = 1;
+				else
+					ev_drained(i, POLLIN);
+				break;
+			}
+			if (accepted(afd, sin4, sin6) < 0)
+				return -1;
+		}
+		return 0;
+
+#ifdef LINUX26
+	// pairs from an acceptor thread
+	} else if (fd2state[i].state == STATE_HANDOFF) {
+		pfds[i].revents = 0;
+		return inbox(i);
+#endif
+
+	// First input data from a client. Now we need to decide where we go.
+	} else if (fd2state[i].state == STATE_DECIDING || fd2state[i].state == STATE_HELLO) {
+
+		// special state transition if we mux SMTP/SSH
+		if (d_local_port == 25) {
+			if (writen(i, smtp_ssh_banner.c_str(), smtp_ssh_banner.size())
+			    != (ssize_t)smtp_ssh_banner.size()) {
+				cleanup(i);
+				return 0;
+			}
+			pfds[i].events = POLLIN;
+			pfds[i].revents = 0;
+			fd2state[i].state = STATE_BANNER_SENT;
+			fd2state[i].last_t = now;
+			return 0;
+		}
+
+		// allow up to d_protocol_ms for clients to send first proto stuff,
+		// unless the history says it waits for the SSH banner
+		bool hello = (fd2state[i].state == STATE_HELLO);
+		if (pfds[i].revents == 0 && fd2state[i].guess == GUESS_NONE &&
+		    now - fd2state[i].last_t < (hello ? (uint32_t)TIMEOUT_HELLO : d_protocol_ms))
+			return 0;
+
+		// last_t is still the time of accept
+		if (hello) {
+			if (pfds[i].revents == 0)
+				++stats.hello_timeouts;
+		} else if (pfds[i].revents != 0)
+			first_byte(now - fd2state[i].last_t);
+		else if (fd2state[i].guess == GUESS_NONE)
+			++stats.silent;
+		bool more = (pfds[i].revents != 0);
+		// a client that shut down halfway through its ClientHello sends no
+		// more of it, so route on what is there
+		bool fin = (pfds[i].revents & POLLRDHUP) != 0;
+		pfds[i].revents = 0;
+
+		if (dstaddr(i, dst, slen) < 0) {
+			err = "sshttp::loop::";
+			err += NS_Socket::why();
+			cleanup(i);
+			return -1;
+		}
+		uint16_t oport = (af == AF_INET) ? dst4.sin_port : dst6.sin6_port;
+
+		if (af == AF_INET)
+			from = (sockaddr *)&fd2state[i].data->from4;
+		else
+			from = (sockaddr *)&fd2state[i].data->from6;
+
+		if (fd2state[i].guess != GUESS_NONE) {
+			dst6.sin6_port = dst4.sin_port = htons(d_ssh_port);
+			++stats.guesses;
+		} else {
+			int port = find_port(i, more && !fin);
+
+			// wait for the rest of a ClientHello, the kernel wakes us up
+			// once it is there
+			if (port < 0) {
+				if (!hello) {
+					++stats.hellos;
+					fd2state[i].state = STATE_HELLO;
+					fd2state[i].last_t = now;
+					pfds[i].events |= POLLRDHUP;
+				}
+				ev_drained(i, POLLIN);
+				return 0;
+			}
+			if (hello)
+				rcvlowat(i, 1);
+
+			dst6.sin6_port = dst4.sin_port = htons(port);
+			if (dst4.sin_port != 0)
+				history.put(from, ntohs(dst4.sin_port));
+		}
+
+		// error?
+		if (dst4.sin_port == 0) {
+			err = "sshttp::loop: Connection reset while detecting protocol.";
+			cleanup(i);
+			return -1;
+		}
+
+		// PROXY backends learn the client address from a header that goes
+		// out before any client data, and are connected to from our own
+		bool proxy = proxied(ntohs(dst4.sin_port));
+		sockaddr_in6 any;
+		if (proxy) {
+			if (proxy_header(i, dst, oport) < 0) {
+				cleanup(i);
+				return -1;
+			}
+			memset(&any, 0, sizeof(any));
+			from = (sockaddr *)&any;
+		}
+
+		// preconnected to sshd already?
+		if (ntohs(dst4.sin_port) != d_ssh_port)
+			drop_spec(i);
+		if (fd2state[i].peer_fd >= 0) {
+			use_spec(i);
+#ifdef LINUX26
+			if (d_acceptor)
+				return hand_over(i);
+#endif
+			return 0;
+		}
+
+		peer_fd = backend_connect(dst, slen, from, slen, proxy ? -1 : i);
+
+		if (peer_fd < 0) {
+			err = "sshttp::loop::";
+			err += NS_Socket::why();
+			cleanup(i);
+			return -1;
+		}
+		if (data_get(peer_fd) < 0) {
+			cleanup(i);
+			close(peer_fd);
+			return -1;
+		}
+
+		fd2state[i].peer_fd = peer_fd;
+		fd2state[i].state = STATE_CONNECTED;
+		fd2state[i].last_t = now;
+
+		fd2state[peer_fd].fd = peer_fd;
+		fd2state[peer_fd].peer_fd = i;
+		fd2state[peer_fd].state = STATE_CONNECTING;
+		fd2state[peer_fd].last_t = now;
+		fd2state[peer_fd].ready = 0;
+		++fd2state[peer_fd].gen;
+
+		pfds[peer_fd].fd = peer_fd;
+		// POLLIN|POLLOUT b/c we wait for connection to finish
+		pfds[peer_fd].events = POLLOUT|POLLIN;
+		pfds[peer_fd].revents = 0;
+		ev_add(peer_fd);
+
+		// No POLLIN. makes no sense as long as peer hasnt
+		// finished connecting. Next state will set it to POLLIN once
+		// both peers are established and ready
+		pfds[i].events = 0;
+		if (peer_fd > max_fd)
+			max_fd = peer_fd;
+#ifdef LINUX26
+		if (d_acceptor)
+			return hand_over(i);
+#endif
+
+	} else if (fd2state[i].state == STATE_CONNECTING) {
+		pfds[i].revents = 0;
+
+		if (finish_connecting(i) < 0) {
+			err = "sshttp::loop::";
+			err += NS_Socket::why();
+			cleanup(fd2state[i].peer_fd);
+			cleanup(i);
+			return -1;
+		}
+		fd2state[i].state = STATE_CONNECTED;
+		fd2state[i].last_t = now;
+		pfds[i].events = POLLIN;
+
+		// see above comment in last state when events was 0.
+		// peer is guranteed to exist, since was setup in last state
+		pfds[fd2state[i].peer_fd].events = POLLIN;
+
+		// a PROXY header or SMTP mode's first client bytes go out first
+		if (fd2state[fd2state[i].peer_fd].blen > 0)
+			pfds[i].events |= POLLOUT;
+#ifdef USE_IO_URING
+		// both ends established, the ring takes over relaying unless the
+		// client still has to be verified
+		if (ring && fd2state[fd2state[i].peer_fd].guess == GUESS_NONE)
+			ring_start(i);
+#endif
+
+	} else if (fd2state[i].state == STATE_CONNECTED) {
+		status *st = &fd2state[i];
+
+		// peer not ready yet (may only happen in smtp case)
+		if (st->peer_fd < 0 || fd2state[st->peer_fd].state != STATE_CONNECTED) {
+			pfds[i].revents = 0;
+			return 0;
+		}
+
+		// backend was picked from the history only, so look at what the
+		// client sends before it goes anywhere
+		if (st->guess != GUESS_NONE && (pfds[i].revents & POLLIN)) {
+			int r = verify(i);
+			if (r != 0)
+				return r < 0 ? -1 : 0;
+		}
+
+		status *peer = &fd2state[st->peer_fd];
+
+		// sshd is about to talk to a client whose backend was guessed,
+		// if the client spoke meanwhile check that first
+		if (peer->guess == GUESS_PENDING && (pfds[i].revents & POLLIN)) {
+			int r = verify(st->peer_fd);
+			if (r != 0)
+				return r < 0 ? -1 : 0;
+		}
+
+		if (pfds[i].revents & POLLOUT) {
+			// actually data to send?
+			if ((n = peer->blen) > 0) {
+				wn = relay_write(i, peer, n);
+
+				// error for i, but let kernel flush internal sendbuffer
+				// for peer (wn > n shouldnt really happen). wn == 0 is EAGAIN,
+				// as edge triggered POLLOUT may be stale.
+				if (wn < 0 || wn > n) {
+					shutdown(st->peer_fd);
+					cleanup(i);
+					return 0;
+				}
+				// non blocking write couldnt write it all at once
+				if (wn < n) {
+					ev_drained(i, POLLOUT);
+					pfds[i].events |= POLLOUT;
+				} else
+					pfds[i].events &= ~POLLOUT;
+
+				// empty pipe goes back to the pool
+				if (peer->blen == 0)
+					pipe_put(peer);
+
+				// peer hung up and all of its data is out now
+				if (peer->blen == 0 && peer->eof) {
+					shutdown(i);
+					cleanup(st->peer_fd);
+					return 0;
+				}
+
+				// room again to read from peer
+				if (!relay_full(peer) && !peer->eof)
+					pfds[st->peer_fd].events |= POLLIN;
+			} else {
+				// no data to send, so take away from output poll for now
+				// and ask for data to read via peer
+				pfds[i].events &= ~POLLOUT;
+				if (!peer->eof)
+					pfds[st->peer_fd].events |= POLLIN;
+			}
+		}
+
+		// Read and pass on to peer right away until EAGAIN or until the
+		// budget is used up. In the latter case fd stays ready and is
+		// served again after the other connections had their turn.
+		if ((pfds[i].revents & POLLIN) && !st->eof) {
+			size_t budget = d_budget;
+			++stats.drain_events;
+
+			for (;;) {
+				// no room for new data until peer has written some
+				if (relay_full(st)) {
+					pfds[i].events &= ~POLLIN;
+					break;
+				}
+				size_t want = 0;
+				n = relay_read(i, st, want);
+
+				if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+					ev_drained(i, POLLIN);
+					buf_idle(st);
+					break;
+				}
+
+				// EOF with data still buffered: stop reading and let the
+				// POLLOUT side of peer flush it before closing
+				if (n == 0 && st->blen > 0) {
+					st->eof = 1;
+					pfds[i].events &= ~POLLIN;
+					break;
+				}
+
+#ifdef USE_SOCKMAP
+				// the kernel may still be sending what came before the
+				// FIN, see offload_close()
+				if (n == 0 && st->offload == OFFLOAD_ACTIVE) {
+					st->eof = 1;
+					st->last_t = peer->last_t = now;
+					pfds[i].events &= ~POLLIN;
+					return 0;
+				}
+#endif
+				if (n <= 0) {
+					shutdown(st->peer_fd);
+					cleanup(i);
+					return 0;
+				}
+				++stats.reads;
+				stats.bytes += n;
+
+				wn = relay_write(st->peer_fd, st, st->blen);
+
+				// error for peer, but let kernel flush internal sendbuffer for i
+				if (wn < 0) {
+					shutdown(i);
+					cleanup(st->peer_fd);
+					return 0;
+				}
+				if (st->blen == 0)
+					pipe_put(st);
+				else
+					ev_drained(st->peer_fd, POLLOUT);
+
+				// short read: socket is drained until the next edge
+				if (want > 0 && n < (ssize_t)want) {
+					ev_drained(i, POLLIN);
+					buf_idle(st);
+					break;
+				}
+				if ((size_t)n >= budget) {
+					++stats.budget_exhausted;
+					break;
+				}
+				budget -= n;
+			}
+
+			// peer has data to write
+			if (st->blen > 0)
+				pfds[st->peer_fd].events |= POLLOUT;
+		}
+
+		// room in the in-buffer, accept new input data in any case
+		if (!relay_full(st) && !st->eof)
+			pfds[i].events |= POLLIN;
+
+		pfds[i].revents = 0;
+		st->last_t = now;
+		peer->last_t = now;
+
+#ifdef USE_SOCKMAP
+		if (d_sockmap && st->offload == OFFLOAD_NONE)
+			offload(i);
+#endif
+	} else {
+		if (smtp_transition(i) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+#ifdef USE_EPOLL
+
+int sshttp::ev_init()
+{
+	if ((efd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		err = "sshttp::ev_init::epoll_create1:";
+		err += strerror(errno);
+		return -1;
+	}
+
+	// the listening socket was set up before we had an epoll fd
+	ev_add(listen_fd);
+	return 0;
+}
+
+
+// All fds are registered edge-triggered for input and output once, so
+// changing interest in pfds[].events costs no syscall. As the kernel only
+// reports transitions, the readiness is remembered in status::ready until the
+// fd would block (ev_drained()).
+void sshttp::ev_add(int fd)
+{
+#ifdef USE_IO_URING
+	if (ring) {
+		ring_poll(fd);
+		return;
+	}
+#endif
+	if (efd < 0)
+		return;
+
+	epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;
+	ev.data.fd = fd;
+	epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+
+void sshttp::ev_del(int fd)
+{
+	if (efd >= 0)
+		epoll_ctl(efd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+
+void sshttp::ev_drained(int fd, short what)
+{
+	status *st = &fd2state[fd];
+
+	// A FIN that arrived together with the last data does not produce
+	// another edge, so stay readable until read() returned 0.
+	if (st->ready & EPOLLRDHUP)
+		what &= ~POLLIN;
+	st->ready &= ~what;
+}
+
+
+// queue fd if it is ready for something we are interested in
+void sshttp::ev_queue(int fd)
+{
+	if (fd < 0 || pfds[fd].fd == -1)
+		return;
+
+	status *st = &fd2state[fd];
+	if (st->queued || (st->ready & (pfds[fd].events|POLLERR|POLLHUP)) == 0)
+		return;
+	st->queued = 1;
+	ready_list.push_back(fd);
+}
+
+
+int sshttp::ev_wait(int ms)
+{
+#ifdef USE_IO_URING
+	if (ring)
+		return ring_wait(ms);
+#endif
+
+	epoll_event evs[1024];
+
+	int n = epoll_wait(efd, evs, sizeof(evs)/sizeof(evs[0]), ms);
+	if (n < 0)
+		return -1;
+
+	for (int j = 0; j < n; ++j) {
+		int fd = evs[j].data.fd;
+
+		// EPOLLIN etc. have the same values as their POLL counterparts
+		fd2state[fd].ready |= evs[j].events & (EPOLLIN|EPOLLOUT|EPOLLERR|EPOLLHUP|EPOLLRDHUP);
+		ev_queue(fd);
+	}
+	return 0;
+}
+
+
+// only touch fds that are ready
+int sshttp::ev_dispatch()
+{
+	work_list.clear();
+	work_list.swap(ready_list);
+
+	for (size_t k = 0; k < work_list.size(); ++k) {
+		int fd = work_list[k];
+		status *st = &fd2state[fd];
+		st->queued = 0;
+		if (pfds[fd].fd == -1)
+			continue;
+
+		int peer = st->peer_fd;
+		pfds[fd].revents = st->ready & (pfds[fd].events|POLLERR|POLLHUP);
+		int r = process(fd);
+
+		// processing may have changed interest and deadlines of fd and its peer
+		ev_timer(fd);
+		ev_timer(peer);
+		ev_queue(fd);
+		ev_queue(peer);
+
+		if (r < 0) {
+			for (++k; k < work_list.size(); ++k)
+				ready_list.push_back(work_list[k]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+#endif
+
+#ifdef USE_IO_URING
+
+// user_data of ring requests: op | bid | fd | gen
+enum {
+	RING_ACCEPT = 1,
+	RING_POLL,
+	RING_RECV,
+	RING_SEND,
+	RING_CANCEL,
+
+	RING_MAX_QUEUE	= 8,	// stop receiving if that many chunks wait for peer
+	RING_MAX_LINK	= 8
+};
+
+
+static inline uint64_t ring_tag(unsigned op, int fd, uint32_t gen, uint16_t bid = 0)
+{
+	return (uint64_t)op | ((uint64_t)bid << 4) | ((uint64_t)(fd & 0x3fffff) << 20) |
+	       ((uint64_t)(gen & 0x3fffff) << 42);
+}
+
+
+int sshttp::ring_init()
+{
+	ring = new (nothrow) uring;
+	if (!ring || ring->init(256) < 0) {
+		err = ring ? ring->why() : "OOM";
+		delete ring;
+		ring = NULL;
+		return -1;
+	}
+	if (fd2state[listen_fd].state == STATE_HANDOFF)
+		ring_poll(listen_fd);
+	else
+		ring_accept();
+	return 0;
+}
+
+
+void sshttp::ring_accept()
+{
+	io_uring_sqe *sqe = ring->get_sqe();
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listen_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+	sqe->user_data = ring_tag(RING_ACCEPT, listen_fd, 0);
+	accept_armed = 1;
+}
+
+
+// Readiness for the non-relay states. Multishot poll reports each wakeup,
+// just like EPOLLET, so it feeds the same ready list as epoll.
+void sshttp::ring_poll(int fd)
+{
+	io_uring_sqe *sqe = ring->get_sqe();
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	if (fd2state[fd].state == STATE_HANDOFF)
+		sqe->poll32_events = EPOLLIN;
+	else
+		sqe->poll32_events = EPOLLIN|EPOLLOUT|EPOLLRDHUP;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = ring_tag(RING_POLL, fd, fd2state[fd].gen);
+}
+
+
+void sshttp::ring_cancel(uint64_t tag)
+{
+	io_uring_sqe *sqe = ring->get_sqe();
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = tag;
+	sqe->user_data = ring_tag(RING_CANCEL, 0, 0);
+}
+
+
+// One provided buffer per recv, re-armed as long as fewer than
+// RING_MAX_QUEUE chunks wait for the peer, so each direction of a session
+// holds at most that many buffers. A multishot recv keeps taking buffers
+// until a cancel gets through, and a slow peer then leaves all other
+// sessions without any.
+void sshttp::ring_recv(int fd)
+{
+	io_uring_sqe *sqe = ring->get_sqe();
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = uring::BGID;
+	sqe->user_data = ring_tag(RING_RECV, fd, fd2state[fd].gen);
+	fd2state[fd].recv_armed = 1;
+}
+
+
+// Send queued chunks of fd to its peer, as one linked chain so they
+// are sent in order. A short send breaks the chain and the rest
+// completes with -ECANCELED, to be resent once the chain is done.
+void sshttp::ring_send(int fd)
+{
+	status *st = &fd2state[fd];
+
+	if (st->inflight > 0 || st->data->rq.empty())
+		return;
+
+	size_t n = st->data->rq.size();
+	if (n > RING_MAX_LINK)
+		n = RING_MAX_LINK;
+
+	for (size_t k = 0; k < n; ++k) {
+		io_uring_sqe *sqe = ring->get_sqe();
+		if (!sqe)
+			break;
+		const ring_chunk &c = st->data->rq[k];
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = st->peer_fd;
+		sqe->addr = (unsigned long)(ring->buf(c.bid) + c.off);
+		sqe->len = c.len - c.off;
+		sqe->msg_flags = MSG_WAITALL|MSG_NOSIGNAL;
+		if (k + 1 < n)
+			sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = ring_tag(RING_SEND, fd, st->gen, c.bid);
+		++st->inflight;
+	}
+}
+
+
+// hand fd and its peer over to the ring for relaying
+void sshttp::ring_start(int fd)
+{
+	int fds[2] = {fd, fd2state[fd].peer_fd};
+
+	// bytes that are already buffered, such as SMTP mode's first client
+	// bytes, are no ring chunks and would be lost. Such pairs stay with
+	// the epoll relay.
+	if (fd2state[fds[0]].blen > 0 || fd2state[fds[1]].blen > 0)
+		return;
+
+	for (int k = 0; k < 2; ++k) {
+		status *st = &fd2state[fds[k]];
+		ring_cancel(ring_tag(RING_POLL, fds[k], st->gen));
+		pfds[fds[k]].events = 0;
+		st->in_ring = 1;
+		st->eof = 0;
+		st->inflight = 0;
+		st->blen = 0;
+		st->data->rq.clear();
+		ring_recv(fds[k]);
+	}
+}
+
+
+// Cancel all requests on fd before it is closed. Chunks that are already
+// being sent are recycled when their CQE arrives.
+void sshttp::ring_release(int fd)
+{
+	if (!ring)
+		return;
+
+	status *st = &fd2state[fd];
+
+	io_uring_sqe *sqe = ring->get_sqe();
+	if (sqe) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = fd;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD|IORING_ASYNC_CANCEL_ALL;
+		sqe->user_data = ring_tag(RING_CANCEL, 0, 0);
+	}
+
+	if (st->in_ring) {
+		for (size_t k = st->inflight; k < st->data->rq.size(); ++k)
+			ring->recycle(st->data->rq[k].bid);
+		st->data->rq.clear();
+		st->in_ring = 0;
+		st->recv_armed = 0;
+		st->eof = 0;
+		st->inflight = 0;
+	}
+
+	// must reach the kernel before close()
+	ring->submit();
+}
+
+
+int sshttp::ring_wait(int ms)
+{
+	// relay threads poll their eventfd instead, an accept on it fails
+	// right away and the wait would never block
+	if (!accept_armed && !heavy_load && fd2state[listen_fd].state != STATE_HANDOFF)
+		ring_accept();
+
+	uint16_t tail = ring->buf_tail();
+
+	if (ring->wait(ms) < 0) {
+		err = ring->why();
+		return -1;
+	}
+
+	now = timer_wheel::clock();
+
+	for (io_uring_cqe *cqe = NULL; (cqe = ring->peek()) != NULL;) {
+		io_uring_cqe c = *cqe;
+		ring->seen();
+		ring_cqe(&c);
+	}
+
+	// receivers that ran out of provided buffers may continue if
+	// some were returned in the meantime
+	if (tail != ring->buf_tail() && !ring_starved.empty()) {
+		vector<int> starved;
+		starved.swap(ring_starved);
+		for (size_t k = 0; k < starved.size(); ++k) {
+			status *st = &fd2state[starved[k]];
+			if (st->in_ring && !st->recv_armed && !st->eof)
+				ring_recv(starved[k]);
+		}
+	}
+
+	return 0;
+}
+
+
+void sshttp::ring_cqe(const io_uring_cqe *cqe)
+{
+	unsigned op = cqe->user_data & 0xf;
+	uint16_t bid = (cqe->user_data >> 4) & 0xffff;
+	int fd = (cqe->user_data >> 20) & 0x3fffff, peer_fd = -1;
+	uint32_t gen = cqe->user_data >> 42;
+	bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+	status *st = NULL;
+	if ((fd2state[fd].gen & 0x3fffff) == gen)
+		st = &fd2state[fd];
+
+	switch (op) {
+	case RING_ACCEPT: {
+		if (!more)
+			accept_armed = 0;
+		if (cqe->res < 0) {
+			if (cqe->res == -EMFILE || cqe->res == -ENFILE)
+				heavy_load = 1;
+			return;
+		}
+		heavy_load = 0;
+
+		sockaddr_in sin4;
+		sockaddr_in6 sin6;
+		sockaddr *sin = (sockaddr *)&sin4;
+		socklen_t slen = sizeof(sin4);
+		if (af == AF_INET6) {
+			sin = (sockaddr *)&sin6;
+			slen = sizeof(sin6);
+		}
+		if (getpeername(cqe->res, sin, &slen) < 0) {
+			close(cqe->res);
+			return;
+		}
+		accepted(cqe->res, sin4, sin6);
+		return;
+	}
+	case RING_POLL:
+		if (!st || st->in_ring || pfds[fd].fd == -1)
+			return;
+		if (!more)
+			ring_poll(fd);
+		if (cqe->res > 0) {
+			st->ready |= cqe->res & (EPOLLIN|EPOLLOUT|EPOLLERR|EPOLLHUP|EPOLLRDHUP);
+			ev_queue(fd);
+		}
+		return;
+	case RING_RECV:
+		if (cqe->flags & IORING_CQE_F_BUFFER)
+			bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+		if (!st || !st->in_ring) {
+			if (cqe->flags & IORING_CQE_F_BUFFER)
+				ring->recycle(bid);
+			return;
+		}
+		st->recv_armed = 0;
+
+		peer_fd = st->peer_fd;
+
+		if (cqe->res > 0) {
+			ring_chunk c = {bid, 0, (uint16_t)cqe->res};
+			st->data->rq.push_back(c);
+			st->blen += cqe->res;
+			st->last_t = now;
+			fd2state[peer_fd].last_t = now;
+			ev_timer(fd);
+			ring_send(fd);
+		} else {
+			if (cqe->flags & IORING_CQE_F_BUFFER)
+				ring->recycle(bid);
+
+			if (cqe->res == 0) {
+				// flush what is queued before closing
+				st->eof = 1;
+				if (st->data->rq.empty()) {
+					shutdown(peer_fd);
+					cleanup(fd);
+				}
+				return;
+			} else if (cqe->res == -ENOBUFS) {
+				ring_starved.push_back(fd);
+				return;
+			} else if (cqe->res != -ECANCELED) {
+				shutdown(peer_fd);
+				cleanup(fd);
+				return;
+			}
+		}
+
+		// re-arm unless the send side has to catch up first
+		if (!st->recv_armed && !st->eof && st->data->rq.size() < RING_MAX_QUEUE)
+			ring_recv(fd);
+		return;
+	case RING_SEND:
+		if (!st || !st->in_ring) {
+			ring->recycle(bid);
+			return;
+		}
+		--st->inflight;
+
+		peer_fd = st->peer_fd;
+
+		if (cqe->res > 0) {
+			ring_chunk &c = st->data->rq.front();
+			c.off += cqe->res;
+			st->blen -= cqe->res;
+			st->last_t = now;
+			fd2state[peer_fd].last_t = now;
+			if (c.off >= c.len) {
+				ring->recycle(c.bid);
+				st->data->rq.erase(st->data->rq.begin());
+			}
+		} else if (cqe->res != -ECANCELED) {
+			// error for peer, but let kernel flush internal sendbuffer for fd
+			shutdown(fd);
+			cleanup(peer_fd);
+			return;
+		}
+
+		if (st->inflight > 0)
+			return;
+		if (!st->data->rq.empty())
+			ring_send(fd);
+		else if (st->eof) {
+			shutdown(peer_fd);
+			cleanup(fd);
+		} else if (!st->recv_armed)
+			ring_recv(fd);
+		return;
+	default:
+		return;
+	}
+}
+
+#endif
+
+
+int sshttp::loop()
+{
+#ifdef USE_EPOLL
+#ifdef USE_IO_URING
+	// if the kernel lacks io_uring support, just go with epoll
+	if (want_uring && !ring && ring_init() < 0)
+		want_uring = 0;
+	if (!ring)
+#endif
+	// created here rather than in init(), so that each multicore
+	// child gets its own epoll instance after the fork
+	if (efd < 0 && ev_init() < 0)
+		return -1;
+#endif
+
+	for (;;) {
+		if (stats_seen != stats_requested)
+			log_stats();
+
+		// sleep until the next deadline, but do not sleep at all
+		// if there is still work from last round
+		now = timer_wheel::clock();
+		int ms = timers.next(now);
+#ifdef USE_EPOLL
+		if (!ready_list.empty())
+			ms = 0;
+		else if (heavy_load && (ms < 0 || ms > 1000))
+			ms = 1000;
+
+		if (ev_wait(ms) < 0)
+			continue;
+
+		now = timer_wheel::clock();
+
+		if (ev_dispatch() < 0)
+			return -1;
+		if (ev_expire() < 0)
+			return -1;
+
+		// Out of fds: walk all of them once per second as the poll()
+		// loop does, so that CLOSING ones are reaped early.
+		if (heavy_load && now - last_sweep >= 1000) {
+			last_sweep = now;
+#ifdef USE_IO_URING
+			// retry multishot accept that was stopped by EMFILE
+			if (ring && !accept_armed)
+				heavy_load = 0;
+#endif
+			for (int i = first_fd; i <= max_fd; ++i) {
+				pfds[i].revents = 0;
+				if (process(i) < 0)
+					return -1;
+				ev_timer(i);
+			}
+		}
+#else
+		if (heavy_load && (ms < 0 || ms > 1000))
+			ms = 1000;
+
+		// STATE_DECIDING etc. may change without data arrival, so wake up
+		// for the next deadline
+		if (poll(pfds, max_fd + 1, ms) < 0)
+			continue;
+
+		now = timer_wheel::clock();
+		ev_expire();
+
+		// assert: pfds[i].fd == i
+		for (int i = first_fd; i <= max_fd; ++i) {
+			if (process(i) < 0)
+				return -1;
+			ev_timer(i);
+		}
+#endif
+#ifdef LINUX26
+		// wake the relay threads once per round, not per pair
+		if (d_acceptor)
+			d_handoff->flush(d_hidx);
+#endif
+		spare_fill();
+		calc_max_fd();
+	}
+	return 0;
+}
+
+
+// returns 0 on error
+// Returns -1 if wait is set and a TLS ClientHello has not fully arrived
+// yet. Nothing is read, so the backend sees all of it.
+int sshttp::find_port(int fd, bool wait)
+{
+	int r = 0;
+	unsigned char buf[HELLO_MAX];
+
+	r = recv(fd, buf, sizeof(buf), MSG_PEEK);
+
+	if ((r < 0 && errno != EAGAIN && errno != EWOULDBLOCK) || r == 0)
+		return 0;
+	// No packet (EAGAIN or EWOULDBLOCK) ? -> SSH
+	else if (r < 0)
+		return d_ssh_port;
+
+	uint16_t p = classes.match(buf, r);
+	if (p > 0)
+		return p;
+
+	// TLS routes configured? Must be https
+	if (tls_routes()) {
+		// Hellos with large key shares are often split across segments.
+		// Have poll() wait until the whole handshake record is queued.
+		if (buf[0] == 0x16) {
+			int need = 5;
+			if (r >= 5)
+				need += buf[3]<<8|buf[4];
+			if (need > (int)sizeof(buf))
+				need = sizeof(buf);
+			if (wait && r < need && rcvlowat(fd, need) == 0)
+				return -1;
+		}
+
+		p = https_to_port(buf, r);
+		if (p > 0)
+			return p;
+
+		// In case we found a parsing error of the ClientHello or no route
+		// matched, pass it to the original https port
+	}
+
+	if (host2port.size() > 0 && buf[0] != 0x16) {
+		p = http_to_port(buf, r);
+		if (p > 0)
+			return p;
+	}
+
+	// no string match? http(s)! (https covered by HTTP_PORT)
+	return d_http_port;
+}
+
+
+// Host header of a plaintext HTTP request, looked up in place. Returns 0
+// if it is not within the peeked bytes, so that such requests go to the
+// default HTTP port.
+uint16_t sshttp::http_to_port(const unsigned char *req, int len)
+{
+	const char *ptr = reinterpret_cast<const char *>(req), *end = ptr + len, *eol = NULL;
+
+	// request line
+	if ((eol = (const char *)memchr(ptr, '\n', end - ptr)) == NULL)
+		return 0;
+
+	for (ptr = eol + 1; ptr < end; ptr = eol + 1) {
+		if ((eol = (const char *)memchr(ptr, '\n', end - ptr)) == NULL)
+			break;
+		const char *lend = eol;
+		if (lend > ptr && lend[-1] == '\r')
+			--lend;
+		// end of headers
+		if (lend == ptr)
+			break;
+		if (lend - ptr <= 5 || strncasecmp(ptr, "host:", 5) != 0)
+			continue;
+
+		const char *h = ptr + 5;
+		while (h < lend && (*h == ' ' || *h == '\t'))
+			++h;
+		while (lend > h && (lend[-1] == ' ' || lend[-1] == '\t'))
+			--lend;
+
+		// strip ":port", but keep [v6] literals whole
+		const char *c = lend;
+		while (c > h && c[-1] >= '0' && c[-1] <= '9')
+			--c;
+		if (c > h && c[-1] == ':' && (h[0] != '[' || c[-2] == ']'))
+			lend = c - 1;
+		if (lend > h && lend[-1] == '.')
+			--lend;
+
+		return host2port.find(h, lend - h);
+	}
+
+	return 0;
+}
+
+
+// unaligned int ptr access
+uint16_t ua_uint16_ntohs(const void *vp)
+{
+	uint16_t x = 0;
+	memcpy(&x, vp, sizeof(x));
 	return ntohs(x);
 }
 
 
-// also returns 0 on error or if no SNI is found
-// See rfc5246 and rfc6066 for the TLS ClientHello format
-// Find the SNI TLS extension inside Client Hello and return the port
-// that was assigned for it in the sni2port map
+// TLS extensions we route on
+enum {
+	TLSEXT_SERVER_NAME = 0,
+	TLSEXT_ALPN = 16,
+	TLSEXT_SUPPORTED_VERSIONS = 43,
+	TLSEXT_ECH = 0xfe0d
+};
+
+
+// GREASE values (RFC 8701) are 0x?a?a
+static inline bool grease(uint16_t v)
+{
+	return (v & 0x0f0f) == 0x0a0a && (v >> 12) == ((v >> 4) & 0xf);
+}
+
+
+// also returns 0 on error or if nothing matches
+// See rfc5246, rfc6066, rfc7301 and rfc8446 for the TLS ClientHello format
+// Collect SNI, ALPN, ECH and the highest offered version in one pass over
+// the extensions, then look them up in that order: ALPN, the outer SNI of
+// ECH hellos, SNI, version.
 uint16_t sshttp::https_to_port(const unsigned char *chello, int bsize)
 {
 	const unsigned char *ptr = chello, *end = chello + bsize;
+	const unsigned char *sni = NULL, *alpn = NULL;
+	uint16_t sni_len = 0, alpn_len = 0, version = 0, p = 0;
+	bool ech = 0;
 
 	// TLS record
 	if (end - ptr <= 5)
@@ -690,6 +2897,7 @@ uint16_t sshttp::https_to_port(const unsigned char *chello, int bsize)
 
 	if (end - ptr <= 5 + 32 + 1)	// record + Random + session_id len
 		return 0;
+	version = ua_uint16_ntohs(ptr + 3);	// legacy_version
 	ptr += 5 + 32;
 
 	uint8_t sessid_len = *ptr;
@@ -716,49 +2924,77 @@ uint16_t sshttp::https_to_port(const unsigned char *chello, int bsize)
 
 	if (end - ptr <= 2)	// Extensions len (sum of all Ex.)
 		return 0;
-	// skip Extensions len and iterate over each extension until we find SNI
+	// skip Extensions len and iterate over each extension
 	ptr += 2;
 
 	for (; ptr < end;) {
-		if (end - ptr <= 2)	// Ex. Type
+		if (end - ptr < 4)	// Ex. Type and Len
 			break;
 		uint16_t etype = ua_uint16_ntohs(ptr);
-		ptr += 2;
-		if (end - ptr <= 2)	// Ex. Len
+		clen = ua_uint16_ntohs(ptr + 2);
+		ptr += 4;
+		if (end - ptr < clen)
 			break;
-		clen = ua_uint16_ntohs(ptr);
-		ptr += 2;
-		if (end - ptr <= clen)
-			break;
-		// servername Ex. found? Go deeper to parse SNI Ex. (what a stupid protocol)
+
+		const unsigned char *e = ptr, *eend = ptr + clen;
+		ptr += clen;
+
+		switch (etype) {
 		// Theoretically there could be a lot of Server Name Types and list of hosts, but
 		// we only allow "hostname" type and just one of them
-		if (etype == 0) {
-			if (end - ptr <= 2)
+		case TLSEXT_SERVER_NAME:
+			if (eend - e < 2 + 1 + 2)	// list len, name type, hostname len
 				break;
-			clen = ua_uint16_ntohs(ptr);	// Server Name List len
-			ptr += 2;
-			if (end - ptr <= clen || end - ptr <= 1)	// 1 for Server Name Type
+			if (e[2] != 0)		// Server Name Type 0 -> Host Name
 				break;
-			if (*ptr != 0)		// Server Name Type 0 -> Host Name
-				break;
-			++ptr;
-			if (end - ptr <= 2)
+			sni_len = ua_uint16_ntohs(e + 3);
+			sni = e + 5;
+			if (eend - sni < sni_len)
+				sni = NULL;
+			break;
+		case TLSEXT_ALPN:
+			if (eend - e < 2)
 				break;
-			clen = ua_uint16_ntohs(ptr);	// hostname len
-			ptr += 2;
-			if (end - ptr < clen)
+			alpn_len = ua_uint16_ntohs(e);
+			alpn = e + 2;
+			if (eend - alpn < alpn_len)
+				alpn = NULL;
+			break;
+		case TLSEXT_SUPPORTED_VERSIONS:
+			if (eend - e < 1)
 				break;
-			string hostname = string(reinterpret_cast<const char *>(ptr), clen);
-			if (sni2port.count(hostname) > 0)
-				return sni2port[hostname];
-
+			for (const unsigned char *v = e + 1; v + 2 <= eend && v + 2 <= e + 1 + *e; v += 2) {
+				uint16_t ver = ua_uint16_ntohs(v);
+				if (!grease(ver) && ver > version)
+					version = ver;
+			}
+			break;
+		case TLSEXT_ECH:
+			ech = 1;
 			break;
+		default:
+			break;
+		}
+	}
 
+	// protocol names in the client's order of preference
+	if (alpn && alpn2port.size() > 0) {
+		for (const unsigned char *a = alpn; a < alpn + alpn_len && a + 1 + *a <= alpn + alpn_len; a += 1 + *a) {
+			if ((p = alpn2port.find(reinterpret_cast<const char *>(a + 1), *a)) > 0)
+				return p;
 		}
-		ptr += clen;
 	}
 
+	// with ECH, SNI is the public name of the client facing server
+	if (ech && (p = ech2port.find(reinterpret_cast<const char *>(sni), sni ? sni_len : 0)) > 0)
+		return p;
+
+	if (sni && (p = sni2port.find(reinterpret_cast<const char *>(sni), sni_len)) > 0)
+		return p;
+
+	map<uint16_t, uint16_t>::const_iterator i = version2port.find(version);
+	if (i != version2port.end())
+		return i->second;
 
 	return 0;
 }
@@ -37,31 +37,228 @@
 #include <poll.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netdb.h>
 #include <string>
 #include <cstring>
 #include <map>
 #include <time.h>
+#include <signal.h>
 #include <sys/time.h>
 #include <stdint.h>
+#include <vector>
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+// poll() without it cannot tell a FIN from data
+#ifndef POLLRDHUP
+#define POLLRDHUP 0
+#endif
+
+#ifdef USE_IO_URING
+#ifndef USE_EPOLL
+#error "USE_IO_URING requires USE_EPOLL"
+#endif
+#include "uring.h"
+#endif
+
+#include "timer.h"
+#include "handoff.h"
+#include "history.h"
+#include "classify.h"
+#include "sni.h"
+
+#ifdef USE_SOCKMAP
+#include "sockmap.h"
+#endif
+
+
+enum {
+	SLAB_CHUNK = 64,
+	BUF_MIN = 4096,
+	BUF_MAX = (1<<18),
+	BUF_POOL_MAX = 1024,		// idle BUF_MIN buffers kept for reuse
+	SPLICE_CHUNK = (1<<16),
+	PIPE_POOL_MAX = 1024,
+	DRAIN_BUDGET = (1<<18),
+	HELLO_MAX = (1<<14) + 5,	// largest TLS record we wait for
+	SPARE_MAX = 64,
+	SPARE_REFILL = 8,		// spare sockets made per loop round
+	ZEROCOPY_MIN = (1<<15),		// smaller sends are cheaper to copy
+	FD_MAX = (1<<16),		// default RLIMIT_NOFILE
+	FD_MAX_RING = (1<<22)		// fds that fit into an io_uring tag
+};
+
+
+// in ms, PROTOCOL and MAILBANNER are defaults for the decision windows
+enum {
+	TIMEOUT_PROTOCOL = 2000,
+	TIMEOUT_MAILBANNER = 3000,
+	TIMEOUT_HELLO = 1000,
+	TIMEOUT_CLOSING = 5000,
+	TIMEOUT_ALIVE  = 30000,
+	TIMEOUT_LINGER = 100
+};
+
+
+// first byte histogram: bucket k counts clients that spoke within 2^k ms
+enum {
+	FIRST_BYTE_BUCKETS = 13
+};
+
+
+// counters that are logged on SIGUSR1
+struct sshttp_stats {
+	uint64_t drain_events, reads, bytes, budget_exhausted;
+	uint64_t handoffs, handoff_drops;
+	uint64_t guesses, misguesses;
+	uint64_t first_byte[FIRST_BYTE_BUCKETS], late, silent;
+	uint64_t spec_used, spec_dropped;
+	uint64_t hellos, hello_timeouts;
+	uint64_t spare_hits, spare_misses;
+	uint64_t tfo_sent, tfo_fallbacks;
+	uint64_t offloads, offload_fails;
+	uint64_t zc_sends, zc_copied;
+
+	sshttp_stats() : drain_events(0), reads(0), bytes(0), budget_exhausted(0),
+	                 handoffs(0), handoff_drops(0), guesses(0), misguesses(0),
+	                 late(0), silent(0), spec_used(0), spec_dropped(0),
+	                 hellos(0), hello_timeouts(0), spare_hits(0), spare_misses(0),
+	                 tfo_sent(0), tfo_fallbacks(0), offloads(0), offload_fails(0),
+	                 zc_sends(0), zc_copied(0)
+	{
+		memset(first_byte, 0, sizeof(first_byte));
+	}
+};
+
+
+struct status;
+
+// Connection state indexed by fd. It grows in chunks to cover the highest
+// fd in use, and chunks never move, so pointers to entries stay valid.
+class status_table {
+	std::vector<status *> chunks;
+
+public:
+	enum {
+		CHUNK = 4096
+	};
+
+	~status_table();
+
+	int grow(int);
+
+	inline status &operator[](int);
+};
 
 
 class sshttp {
 private:
+	// fd_cap entries, grown by fd_room()
 	struct pollfd *pfds;
-	int first_fd, max_fd;
+	int first_fd, max_fd, fd_limit, fd_cap, listen_fd;
+
+	// indexed by fd, as pfds
+	status_table fd2state;
+
+	// free status_data, allocated in chunks of SLAB_CHUNK
+	struct status_data *free_data;
+#ifdef USE_EPOLL
+	int efd;
+	uint64_t last_sweep;
+	std::vector<int> ready_list, work_list;
+#endif
+#ifdef USE_IO_URING
+	uring *ring;
+	bool want_uring, accept_armed;
+	std::vector<int> ring_starved;
+#endif
 	uint16_t d_ssh_port, d_http_port, d_local_port;
 
-	time_t now;
+	// monotonic ms
+	uint64_t now;
+
+	// connection deadlines
+	timer_wheel timers;
+	std::vector<timer_wheel::entry> expired;
 
 	int af;
 
-	bool heavy_load;
+	bool heavy_load, d_splice, d_preconnect, d_fastopen, d_zerocopy;
+
+	uint32_t d_buf_max, d_budget, d_spare_max, d_fd_max;
+
+	// decision windows in ms
+	uint32_t d_protocol_ms, d_banner_ms;
+
+	// SO_REUSEPORT listeners, one per worker, steered to the CPUs of
+	// workers d_shard_cpu and following
+	int d_shards, d_shard_cpu;
+	std::vector<int> shards;
+#ifdef LINUX26
+	// acceptor and relay threads, see handoff.h
+	handoff *d_handoff;
+	int d_hidx;
+	bool d_acceptor;
+#endif
+#ifdef USE_SOCKMAP
+	// kernel relaying of established pairs, shared by the threads of
+	// a process
+	sockmap *d_sockmap;
+#endif
+
+	sshttp_stats stats;
+	sig_atomic_t stats_seen;
+
+	std::string err, smtp_ssh_banner;
+
+	// -N names, ALPN protocols, ECH public names and HTTP Host headers,
+	// compiled by setup()
+	sni_table sni2port, alpn2port, ech2port, host2port;
+	std::map<uint16_t, uint16_t> version2port;
+
+	// backend ports that get a PROXY v2 header instead of a transparent
+	// connect
+	std::vector<uint16_t> d_proxy;
+
+	// backend ports served by a local stream socket, by path
+	std::map<uint16_t, std::string> d_unix;
+
+	// -X signatures in the order given, compiled into classes by setup()
+	std::vector<std::pair<std::string, uint16_t> > rules;
+	classifier classes;
+
+	// last decided port per client address
+	proto_history history;
+
+	// pool of idle splice pipes, read end followed by write end
+	std::vector<int> pipes;
+
+	// BUF_MIN buffers taken from sessions with nothing to relay
+	std::vector<char *> bufs;
+
+	// backend sockets prepared in idle time, sized by the recent connect
+	// rate (per second, spare_count connects since spare_t)
+	std::vector<int> spares;
+	uint32_t spare_rate, spare_count;
+	uint64_t spare_t;
+
+	int listener(const addrinfo *, bool);
+
+	int setup(int);
 
-	std::string err;
+	int fd_room(int);
 
-	std::map<int, struct status *> fd2state;
+	int data_get(int);
 
-	std::map<std::string, uint16_t> sni2port;
+	int buf_reserve(struct status *);
+
+	void buf_idle(struct status *);
+
+	bool relay_full(const struct status *);
+
+	void data_put(struct status *);
 
 	void cleanup(int);
 
@@ -69,15 +266,158 @@ private:
 
 	void calc_max_fd();
 
-	uint16_t find_port(int);
+	int find_port(int, bool);
 
 	uint16_t https_to_port(const unsigned char *, int);
 
+	int backend_connect(const sockaddr *, socklen_t, const sockaddr *, socklen_t, int = -1);
+
+	void spare_fill();
+
+	bool proxied(uint16_t p) const
+	{
+		for (size_t k = 0; k < d_proxy.size(); ++k) {
+			if (d_proxy[k] == p)
+				return 1;
+		}
+		return 0;
+	}
+
+	int proxy_header(int, const sockaddr *, uint16_t);
+
+#ifdef USE_SOCKMAP
+	void offload(int);
+
+	void offload_close(int);
+
+	void offload_end(int);
+#endif
+
+	uint16_t http_to_port(const unsigned char *, int);
+
+	bool tls_routes() const
+	{
+		return sni2port.size() > 0 || alpn2port.size() > 0 || ech2port.size() > 0 ||
+		       version2port.size() > 0;
+	}
+
+	int pipe_get(struct status *);
+
+	void pipe_put(struct status *);
+
+	ssize_t relay_read(int, struct status *, size_t &);
+
+	ssize_t relay_write(int, struct status *, size_t);
+
+#ifdef LINUX26
+	bool zerocopy(int, const struct status *, size_t);
+
+	int zerocopy_done(int);
+#endif
+
+	int accepted(int, const sockaddr_in &, const sockaddr_in6 &);
+
+	int process(int);
+
+	int verify(int);
+
+	void preconnect(int);
+
+	void speculating(int);
+
+	void drop_spec(int);
+
+	void use_spec(int);
+
+	void first_byte(uint64_t);
+
+	uint64_t deadline(const struct status *);
+
+	void ev_timer(int);
+
+	int ev_expire();
+
+#ifdef LINUX26
+	void detach(int);
+
+	int hand_over(int);
+
+	int adopt(const handoff::item &);
+
+	int inbox(int);
+#endif
+
+#ifdef USE_EPOLL
+	int ev_init();
+
+	void ev_add(int);
+
+	void ev_del(int);
+
+	void ev_drained(int, short);
+
+	void ev_queue(int);
+
+	int ev_wait(int);
+
+	int ev_dispatch();
+#else
+	void ev_add(int) {}
+
+	void ev_del(int) {}
+
+	void ev_drained(int, short) {}
+#endif
+
+#ifdef USE_IO_URING
+	int ring_init();
+
+	int ring_wait(int);
+
+	void ring_cqe(const io_uring_cqe *);
+
+	void ring_accept();
+
+	void ring_poll(int);
+
+	void ring_start(int);
+
+	void ring_recv(int);
+
+	void ring_send(int);
+
+	void ring_cancel(uint64_t);
+
+	void ring_release(int);
+#endif
+
 public:
-	sshttp() : pfds(NULL), d_ssh_port(22), d_http_port(8080), d_local_port(80), now(0),
-	           af(AF_INET), heavy_load(0), err("") {}
+	sshttp() : pfds(NULL), first_fd(0), max_fd(0), fd_limit(0), fd_cap(0), listen_fd(-1), free_data(NULL),
+#ifdef USE_EPOLL
+	           efd(-1), last_sweep(0),
+#endif
+#ifdef USE_IO_URING
+	           ring(NULL), want_uring(0), accept_armed(0),
+#endif
+	           d_ssh_port(22), d_http_port(8080), d_local_port(80), now(0),
+	           af(AF_INET), heavy_load(0), d_splice(0), d_preconnect(0), d_fastopen(0), d_zerocopy(0),
+	           d_buf_max(BUF_MAX), d_budget(DRAIN_BUDGET), d_spare_max(SPARE_MAX), d_fd_max(FD_MAX),
+	           d_protocol_ms(TIMEOUT_PROTOCOL), d_banner_ms(TIMEOUT_MAILBANNER),
+	           d_shards(1), d_shard_cpu(0),
+#ifdef LINUX26
+	           d_handoff(NULL), d_hidx(0), d_acceptor(0),
+#endif
+#ifdef USE_SOCKMAP
+	           d_sockmap(NULL),
+#endif
+	           stats_seen(0), err(""), spare_rate(0), spare_count(0), spare_t(0) {}
 
-	~sshttp() {};
+	~sshttp()
+	{
+#ifdef USE_IO_URING
+		delete ring;
+#endif
+	}
 
 	void ssh_port(uint16_t p)
 	{
@@ -89,15 +429,195 @@ public:
 		d_http_port = p;
 	}
 
+	// upper limit for the per direction relay buffers
+	void buffer_max(uint32_t n)
+	{
+		d_buf_max = n < BUF_MIN ? (uint32_t)BUF_MIN : n;
+	}
+
+	// RLIMIT_NOFILE to set up, each session takes two fds. The fd
+	// indexed tables only grow as far as fds are in use.
+	void fd_max(uint32_t n)
+	{
+		if (n < 1024)
+			n = 1024;
+		d_fd_max = n < FD_MAX_RING ? n : (uint32_t)FD_MAX_RING;
+	}
+
+	// bytes relayed per readiness event before moving on to the next
+	// connection
+	void drain_budget(uint32_t n)
+	{
+		d_budget = n ? n : 1;
+	}
+
+	// bumped by the SIGUSR1 handler, every worker logs once per bump
+	static volatile sig_atomic_t stats_requested;
+
+	void log_stats();
+
+	// how long to wait for a client to speak before it is taken for SSH
+	void protocol_timeout(uint32_t ms)
+	{
+		d_protocol_ms = ms;
+	}
+
+	// SMTP mode: how long to wait for the answer to our banner
+	void banner_timeout(uint32_t ms)
+	{
+		d_banner_ms = ms;
+	}
+
+	// entries of the protocol history, 0 to disable
+	void history_size(uint32_t n)
+	{
+		history.resize(n);
+	}
+
+	// most backend sockets to keep prepared, 0 disables the pool
+	void spare_max(uint32_t n)
+	{
+		d_spare_max = n;
+	}
+
+	// connect to backend port p from our own address and tell it the
+	// client's in a PROXY v2 header
+	void proxy_port(uint16_t p)
+	{
+		d_proxy.push_back(p);
+	}
+
+	// connect to the AF_UNIX socket at path wherever backend port p
+	// would be used
+	void unix_port(uint16_t p, const std::string &path)
+	{
+		d_unix[p] = path;
+	}
+
+	// send the client's first bytes to the backend with the SYN
+	void use_fastopen(bool b)
+	{
+		d_fastopen = b;
+	}
+
+	// connect to sshd while a client is still deciding
+	void use_preconnect(bool b)
+	{
+		d_preconnect = b;
+	}
+
+	// zero-copy relaying via splice(2)
+	void use_splice(bool b)
+	{
+		d_splice = b;
+	}
+
+	// send large chunks of bulk flows with MSG_ZEROCOPY
+	void use_zerocopy(bool b)
+	{
+		d_zerocopy = b;
+	}
+
 	int init(int, const std::string &, const std::string &, bool tproxy = false);
 
+	int init(int, const std::string &, int);
+
+	// number of SO_REUSEPORT listeners to create in init(), and the
+	// first worker whose CPU gets the first of them
+	void reuseport(int n, int first_cpu = 0)
+	{
+		d_shards = n;
+		d_shard_cpu = first_cpu;
+	}
+
+	int use_shard(int);
+
+	int shard_fd(int);
+
+#ifdef USE_IO_URING
+	// opt-in io_uring engine, falls back to epoll if the kernel lacks it
+	void use_uring(bool b)
+	{
+		want_uring = b;
+	}
+#endif
+
+#ifdef USE_SOCKMAP
+	// leave established pairs with nothing buffered to the kernel
+	void offload_to(sockmap *m)
+	{
+		d_sockmap = m;
+	}
+#endif
+
+#ifdef LINUX26
+	// accept and decide only, pairs are passed on to relay threads via h
+	void acceptor_of(handoff *h, int idx)
+	{
+		d_handoff = h;
+		d_hidx = idx;
+		d_acceptor = 1;
+		// guesses are verified by the relay thread, which could not
+		// correct our history
+		history.resize(0);
+#ifdef USE_IO_URING
+		// short lived work only, epoll does fine
+		want_uring = 0;
+#endif
+	}
+
+	// relay pairs of h, needs init() on h->event_fd(idx) rather than a
+	// listener
+	void relay_for(handoff *h, int idx)
+	{
+		d_handoff = h;
+		d_hidx = idx;
+		d_acceptor = 0;
+	}
+#endif
+
 	int smtp_transition(int);
 
 	int loop();
 
 	void add_sni(const std::string &s, uint16_t p)
 	{
-		sni2port[s] = p;
+		sni2port.add(s, p);
+	}
+
+	// plaintext HTTP by Host header
+	void add_host(const std::string &s, uint16_t p)
+	{
+		host2port.add(s, p);
+	}
+
+	void add_alpn(const std::string &s, uint16_t p)
+	{
+		alpn2port.add(s, p);
+	}
+
+	// route ECH hellos by their public name
+	void add_ech(const std::string &s, uint16_t p)
+	{
+		ech2port.add(s, p);
+	}
+
+	// highest offered TLS version, e.g. 0x0303 for clients without 1.3
+	void add_version(uint16_t v, uint16_t p)
+	{
+		version2port[v] = p;
+	}
+
+	// route clients whose first bytes match sig to port p
+	int add_rule(const std::string &sig, uint16_t p)
+	{
+		classifier c;
+		if (c.add(sig, p) < 0) {
+			err = c.why();
+			return -1;
+		}
+		rules.push_back(std::make_pair(sig, p));
+		return 0;
 	}
 
 	const char *why();
@@ -113,34 +633,107 @@ typedef enum {
 	STATE_CONNECTED,
 	STATE_BANNER_CONNECTED,
 	STATE_CLOSING,
+	STATE_HANDOFF,
+	STATE_SPEC_CONNECTING,	// preconnect to sshd for a deciding client
+	STATE_SPEC_CONNECTED,	// sshd output is held in the socket
+	STATE_HELLO,		// waiting for the rest of a TLS ClientHello
 	STATE_NONE
 } status_t;
 
 
+// status::guess, backend was picked from the history only
+enum {
+	GUESS_NONE = 0,
+	GUESS_PENDING,	// nothing relayed to the client yet, may still re-route
+	GUESS_SENT
+};
+
+
+// status::offload
 enum {
-	TIMEOUT_PROTOCOL = 2,
-	TIMEOUT_MAILBANNER = 3,
-	TIMEOUT_CLOSING = 5,
-	TIMEOUT_ALIVE  = 30
+	OFFLOAD_NONE = 0,
+	OFFLOAD_ACTIVE,	// relayed by the sockmap
+	OFFLOAD_NEVER	// the sockmap refused the pair
+};
+
+
+// status_data::zerocopy, SO_ZEROCOPY on the fd
+enum {
+	ZEROCOPY_NONE = 0,
+	ZEROCOPY_ON,
+	ZEROCOPY_OFF	// not supported, or the kernel copies anyway
+};
+
+
+// a send from the relay buffer, id is the socket's MSG_ZEROCOPY counter
+struct zc_send {
+	uint32_t id, len;
+	bool done;
 };
 
 
+// Cold part of a connection, taken from a slab while the fd is in use
+struct status_data {
+	char *buf;	// ring buffer, blen bytes from head on pending
+	uint32_t size, head;
+	struct sockaddr_in from4;
+	struct sockaddr_in6 from6;
+#ifdef USE_IO_URING
+	std::vector<ring_chunk> rq;	// received, not yet sent to peer
+#endif
+	// sends to the peer the kernel still reads from, the zc_len bytes
+	// before head, oldest first
+	std::vector<zc_send> zq;
+	uint32_t zc_len, zc_next;
+	uint8_t zerocopy;
+	status_data *next;	// slab free list
+
+	status_data() : buf(NULL), size(0), head(0), zc_len(0), zc_next(0), zerocopy(ZEROCOPY_NONE),
+	                next(NULL) {}
+};
+
+
+// What event dispatch looks at, one cache line per fd in sshttp::fd2state
 struct status {
 	int fd, peer_fd;
 	status_t state;
-	time_t last_t;
-	char buf[1024];
-	uint16_t blen;
-	struct sockaddr_in from4;
-	struct sockaddr_in6 from6;
+	uint32_t blen;
+	uint32_t gen;	// bumped for every new connection on this fd
+	int pipefd[2];	// splice pipe while data is in flight, blen bytes in it
+	short ready;	// sticky POLL* readiness for edge triggered epoll
+	bool queued;
+	bool eof;	// peer closed, pending data still to be flushed
+	uint8_t guess;
+#ifdef USE_IO_URING
+	bool in_ring, recv_armed;	// relayed by io_uring
+	uint16_t inflight;
+#endif
+#ifdef USE_SOCKMAP
+	uint8_t offload;
+#endif
+	uint64_t last_t, expire;	// last activity, armed timer (0 if none)
+	status_data *data;
 
 	status()
-	 : fd(-1), peer_fd(-1), state(STATE_NONE)
+	 : fd(-1), peer_fd(-1), state(STATE_NONE), blen(0), gen(0), ready(0), queued(0), eof(0), guess(GUESS_NONE),
+#ifdef USE_IO_URING
+	   in_ring(0), recv_armed(0), inflight(0),
+#endif
+#ifdef USE_SOCKMAP
+	   offload(OFFLOAD_NONE),
+#endif
+	   last_t(0), expire(0), data(NULL)
 	{
-		memset(buf, 0, sizeof(buf)); blen = 0;
+		pipefd[0] = pipefd[1] = -1;
 	}
 };
 
 
+inline status &status_table::operator[](int fd)
+{
+	return chunks[(unsigned)fd / CHUNK][(unsigned)fd % CHUNK];
+}
+
+
 #endif
 
@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2026 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <time.h>
+#include <stdint.h>
+#include <climits>
+#include <vector>
+#include "timer.h"
+
+
+using namespace std;
+
+
+timer_wheel::timer_wheel()
+	: current(clock())
+{
+	for (int l = 0; l < LEVELS; ++l)
+		count[l] = 0;
+}
+
+
+uint64_t timer_wheel::clock()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+void timer_wheel::place(const entry &e)
+{
+	uint64_t expire = e.expire;
+
+	if (expire < current)
+		expire = current;
+
+	// too far ahead: park it in the outermost level, it is placed
+	// again on cascade
+	if (expire - current >= ((uint64_t)1<<(LEVELS*BITS)))
+		expire = current + ((uint64_t)1<<(LEVELS*BITS)) - 1;
+
+	// lowest level on which expire and current only differ in that
+	// levels slot index
+	int l = 0;
+	for (; l < LEVELS - 1; ++l) {
+		if ((expire>>((l + 1)*BITS)) == (current>>((l + 1)*BITS)))
+			break;
+	}
+
+	slots[l][(expire>>(l*BITS)) & MASK].push_back(e);
+	++count[l];
+}
+
+
+void timer_wheel::cascade(int l)
+{
+	vector<entry> v;
+	v.swap(slots[l][(current>>(l*BITS)) & MASK]);
+	count[l] -= v.size();
+	for (size_t k = 0; k < v.size(); ++k)
+		place(v[k]);
+}
+
+
+void timer_wheel::add(int fd, uint32_t gen, uint64_t expire)
+{
+	entry e = {fd, gen, expire};
+	place(e);
+}
+
+
+void timer_wheel::advance(uint64_t now, vector<entry> &expired)
+{
+	while (current <= now) {
+		if (count[0] > 0) {
+			vector<entry> &v = slots[0][current & MASK];
+			for (size_t k = 0; k < v.size(); ++k) {
+				if (v[k].expire <= now)
+					expired.push_back(v[k]);
+				else
+					place(v[k]);	// parked one, still in the future
+			}
+			count[0] -= v.size();
+			v.clear();
+			++current;
+		} else {
+			// nothing on level 0, skip to the end of its round
+			uint64_t end = (current | MASK) + 1;
+			current = end <= now ? end : now + 1;
+		}
+
+		if ((current & MASK) != 0)
+			continue;
+
+		// a round on level 0 is over, cascade from the highest level
+		// that wrapped as well
+		int top = 1;
+		while (top < LEVELS - 1 && ((current>>(top*BITS)) & MASK) == 0)
+			++top;
+		for (int l = top; l > 0; --l) {
+			if (count[l] > 0)
+				cascade(l);
+		}
+	}
+}
+
+
+int timer_wheel::next(uint64_t now)
+{
+	if (size() == 0)
+		return -1;
+
+	for (int l = 0; l < LEVELS; ++l) {
+		if (count[l] == 0)
+			continue;
+
+		// slot index of current on level 0 may hold timers, on higher
+		// levels only the following ones can
+		unsigned idx = (current>>(l*BITS)) & MASK;
+		for (unsigned s = (l == 0 ? idx : idx + 1); s < SLOTS; ++s) {
+			const vector<entry> &v = slots[l][s];
+			if (v.empty())
+				continue;
+			uint64_t t = v[0].expire;
+			for (size_t k = 1; k < v.size(); ++k) {
+				if (v[k].expire < t)
+					t = v[k].expire;
+			}
+			if (t <= now)
+				return 0;
+			if (t - now > INT_MAX)
+				return INT_MAX;
+			return (int)(t - now);
+		}
+	}
+
+	// only parked timers, wake up for their cascade
+	return 1000;
+}
+
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2026 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef sshttp_timer_h
+#define sshttp_timer_h
+
+#include <stdint.h>
+#include <vector>
+
+
+// Hierarchical timer wheel with 1ms ticks. Each level has SLOTS slots,
+// a slot on level l spans SLOTS^l ticks and is cascaded down into the
+// lower levels once the wheel reaches it. Timers are not removed when
+// cancelled; the owner recognizes stale ones by (fd, gen, expire).
+class timer_wheel {
+public:
+	struct entry {
+		int fd;
+		uint32_t gen;
+		uint64_t expire;
+	};
+
+private:
+	enum {
+		LEVELS	= 4,
+		BITS	= 6,
+		SLOTS	= (1<<BITS),
+		MASK	= SLOTS - 1
+	};
+
+	std::vector<entry> slots[LEVELS][SLOTS];
+	size_t count[LEVELS];
+
+	// all timers before current have been expired
+	uint64_t current;
+
+	void place(const entry &);
+
+	void cascade(int);
+
+public:
+	timer_wheel();
+
+	// monotonic clock in ms
+	static uint64_t clock();
+
+	void add(int, uint32_t, uint64_t);
+
+	// move all timers that expire up to and including now to expired
+	void advance(uint64_t, std::vector<entry> &);
+
+	// ms until the next timer expires, -1 if none is armed
+	int next(uint64_t);
+
+	size_t size()
+	{
+		size_t n = 0;
+		for (int l = 0; l < LEVELS; ++l)
+			n += count[l];
+		return n;
+	}
+};
+
+
+#endif
+
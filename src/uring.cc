@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2026 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+
+using namespace std;
+
+
+uring::uring()
+	: rfd(-1), sq_head(NULL), sq_tail(NULL), sq_mask(NULL), sq_array(NULL), cq_head(NULL),
+	  cq_tail(NULL), cq_mask(NULL), sqes(NULL), cqes(NULL), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED),
+	  sq_len(0), cq_len(0), sqes_len(0), sq_entries(0), pending(0), br(NULL), bufs(NULL), br_tail(0)
+{
+}
+
+
+uring::~uring()
+{
+	if (sqes)
+		munmap(sqes, sqes_len);
+	if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+		munmap(cq_ptr, cq_len);
+	if (sq_ptr != MAP_FAILED)
+		munmap(sq_ptr, sq_len);
+	if (rfd >= 0)
+		close(rfd);
+	free(br);
+	free(bufs);
+}
+
+
+int uring::init(unsigned entries)
+{
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	// multishot accept and poll can produce a lot of CQEs per SQE
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = entries * 4;
+
+	if ((rfd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+		err = "uring::init::io_uring_setup:";
+		err += strerror(errno);
+		return -1;
+	}
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG) ||
+	    !(p.features & IORING_FEAT_NODROP)) {
+		err = "uring::init: Kernel too old.";
+		return -1;
+	}
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	if (cq_len > sq_len)
+		sq_len = cq_len;
+	cq_len = sq_len;
+
+	sq_ptr = mmap(NULL, sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, rfd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED) {
+		err = "uring::init::mmap:";
+		err += strerror(errno);
+		return -1;
+	}
+	cq_ptr = sq_ptr;
+
+	sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+	sqes = (io_uring_sqe *)mmap(NULL, sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, rfd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		sqes = NULL;
+		err = "uring::init::mmap:";
+		err += strerror(errno);
+		return -1;
+	}
+
+	char *sq = (char *)sq_ptr, *cq = (char *)cq_ptr;
+	sq_head = (unsigned *)(sq + p.sq_off.head);
+	sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	sq_array = (unsigned *)(sq + p.sq_off.array);
+	cq_head = (unsigned *)(cq + p.cq_off.head);
+	cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+	sq_entries = p.sq_entries;
+
+	// provided buffer ring for recv (5.19+)
+	if (posix_memalign((void **)&br, getpagesize(), NBUFS * sizeof(io_uring_buf)) != 0 ||
+	    posix_memalign((void **)&bufs, getpagesize(), (size_t)NBUFS * BUFSIZE) != 0) {
+		err = "uring::init: OOM";
+		return -1;
+	}
+	memset(br, 0, NBUFS * sizeof(io_uring_buf));
+
+	io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)br;
+	reg.ring_entries = NBUFS;
+	reg.bgid = BGID;
+	if (syscall(__NR_io_uring_register, rfd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		err = "uring::init::io_uring_register:";
+		err += strerror(errno);
+		return -1;
+	}
+
+	for (unsigned i = 0; i < NBUFS; ++i)
+		recycle(i);
+
+	return 0;
+}
+
+
+int uring::enter(unsigned to_submit, unsigned min_complete, unsigned flags, int ms)
+{
+	io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+
+	memset(&arg, 0, sizeof(arg));
+	// no timeout at all for ms < 0
+	if (ms >= 0) {
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = (ms % 1000) * 1000000;
+		arg.ts = (unsigned long)&ts;
+	}
+
+	return syscall(__NR_io_uring_enter, rfd, to_submit, min_complete,
+	               flags|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+
+// returns a zeroed SQE, flushing the SQ to the kernel if it is full
+io_uring_sqe *uring::get_sqe()
+{
+	unsigned tail = *sq_tail;
+
+	if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+		submit();
+		if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+			return NULL;
+	}
+
+	unsigned idx = tail & *sq_mask;
+	io_uring_sqe *sqe = &sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[idx] = idx;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++pending;
+	return sqe;
+}
+
+
+int uring::submit()
+{
+	if (pending == 0)
+		return 0;
+
+	int r = enter(pending, 0, 0, 0);
+	if (r < 0) {
+		err = "uring::submit::io_uring_enter:";
+		err += strerror(errno);
+		return -1;
+	}
+	pending -= r;
+	return 0;
+}
+
+
+// submit pending SQEs and wait up to ms for at least one CQE
+int uring::wait(int ms)
+{
+	unsigned min_complete = ms != 0 ? 1 : 0;
+
+	if (peek())
+		min_complete = 0;
+
+	int r = enter(pending, min_complete, IORING_ENTER_GETEVENTS, ms);
+	if (r < 0 && errno != ETIME && errno != EINTR) {
+		err = "uring::wait::io_uring_enter:";
+		err += strerror(errno);
+		return -1;
+	}
+	if (r > 0)
+		pending -= r;
+	return 0;
+}
+
+
+io_uring_cqe *uring::peek()
+{
+	unsigned head = *cq_head;
+
+	if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &cqes[head & *cq_mask];
+}
+
+
+void uring::seen()
+{
+	__atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+// hand a buffer back to the kernel. The ring tail overlays the resv field
+// of the first entry (struct io_uring_buf_ring is not usable from C++, as
+// its flex array is misplaced there).
+void uring::recycle(uint16_t bid)
+{
+	io_uring_buf *b = &br[br_tail & (NBUFS - 1)];
+
+	b->addr = (unsigned long)buf(bid);
+	b->len = BUFSIZE;
+	b->bid = bid;
+	++br_tail;
+	__atomic_store_n(&br[0].resv, br_tail, __ATOMIC_RELEASE);
+}
+
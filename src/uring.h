@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2026 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef sshttp_uring_h
+#define sshttp_uring_h
+
+#include <stdint.h>
+#include <string>
+#include <linux/io_uring.h>
+
+
+// a received chunk inside a provided buffer that still has to be sent
+struct ring_chunk {
+	uint16_t bid, off, len;
+};
+
+
+// Minimal io_uring wrapper on top of the raw syscalls (no liburing
+// dependency), with one ring of provided buffers for recv.
+class uring {
+private:
+	int rfd;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+	unsigned sq_entries, pending;
+
+	struct io_uring_buf *br;
+	unsigned char *bufs;
+	uint16_t br_tail;
+
+	std::string err;
+
+	int enter(unsigned, unsigned, unsigned, int);
+
+public:
+	enum {
+		BGID	= 0,
+		NBUFS	= 1024,		// must be power of 2
+		BUFSIZE	= 4096
+	};
+
+	uring();
+
+	~uring();
+
+	int init(unsigned);
+
+	struct io_uring_sqe *get_sqe();
+
+	int submit();
+
+	int wait(int);
+
+	struct io_uring_cqe *peek();
+
+	void seen();
+
+	unsigned char *buf(uint16_t bid)
+	{
+		return bufs + (size_t)bid * BUFSIZE;
+	}
+
+	void recycle(uint16_t);
+
+	uint16_t buf_tail()
+	{
+		return br_tail;
+	}
+
+	const char *why()
+	{
+		return err.c_str();
+	}
+};
+
+
+#endif
+